@@ -17,13 +17,21 @@ Reed Relais SIL 7271-D 5V:
 From own measurements:
 - Switch bouncing: 40us
 - Delay: 5V Out to relais switching: < 250us
+The delay of the used actuator (relay or solid state) can be measured
+with the self-test (see src/Measurement/Actuator.h). The measured delay is
+subtracted from all lag times.
 
 
 Measurement accuracy:
-The code is not optimized, i.e. no assembler code is used for measurement.
-But the C-code has an internal check for accuracy.
-It aborts if accuracy gets too bad.
-Current accuracy is < 1ms.
+The analog inputs are sampled by the ADC in free running mode (every 26us at 16MHz).
+The time of each sample is latched in the conversion complete interrupt, i.e.
+the result does not depend on the speed of the measurement loop.
+The code checks that no samples are lost. It aborts if this happens.
+The real resolution is measured in each run: the samples per cycle and the
+min/mean/max time between 2 samples are shown with the results (and sent
+with the serial output and the result stream). Typically 26us, 52us for
+the SVGA -> Photosensor test (2 inputs interleaved). The crossing time is
+interpolated between 2 samples.
 I also measured the lag directly with a LED connected to the relais. The
 measured lag was 1ms in 100 trials.
 
@@ -42,17 +50,27 @@ However it was tested only with a 16MHz CPU.
 #include "src/Measurement/Utilities.h"
 #include "src/Measurement/Common.h"
 #include "src/Measurement/Measure.h"
+#include "src/Measurement/Timebase.h"
+#include "src/Measurement/Sampler.h"
+#include "src/Measurement/ResultStream.h"
+#include "src/Measurement/Waveform.h"
+#include "src/Measurement/ResponseTime.h"
+#include "src/Measurement/Stimulus.h"
+#include "src/Measurement/RefreshRate.h"
+#include "src/Measurement/Button.h"
+#include "src/Measurement/Actuator.h"
+#include "src/Measurement/Scheduler.h"
+#include "src/usb/reportintervals.h"
 
 // The SW version.
 #define SW_VERSION "1.4"
 
-// Enable this to get some additional output over serial port (especially for usblag).
-//#define SERIAL_IF_ENABLED
+// Note: SERIAL_IF_ENABLED is defined in Common.h.
 
 
 // Define used Keys.
 // Lagmeter:
-const int KEY_TEST_PHOTO_BUTTON = LCD_KEY_SELECT;
+const int KEY_MENU = LCD_KEY_SELECT;
 const int KEY_MEASURE_PHOTO = LCD_KEY_DOWN;
 const int KEY_MEASURE_SVGA = LCD_KEY_UP;
 const int KEY_MEASURE_SVGA_TO_PHOTO = LCD_KEY_LEFT;
@@ -61,6 +79,7 @@ const int KEY_MEASURE_MIN_TIME = LCD_KEY_RIGHT;
 const int KEY_USBLAG_MEASURE = LCD_KEY_DOWN;
 const int KEY_USBLAG_MEASURE_1MS = LCD_KEY_UP;
 const int KEY_USBLAG_TEST_BUTTON = LCD_KEY_SELECT;
+const int KEY_USBLAG_ANALYZE = LCD_KEY_LEFT;
 
 
 
@@ -125,6 +144,13 @@ void printJoystickButtonChanged() {
 
 
 
+// Task: Polls the USB devices.
+// Executed by the main loop and by all waits (see Scheduler.h).
+void usbTask() {
+	Usb.Task();
+}
+
+
 // SETUP
 void setup() {
 
@@ -143,11 +169,11 @@ void setup() {
 
 	// Lagmeter initialization
 	//pinMode(OUT_PIN_BUTTON, OUTPUT); Already setup by setupMeasurement.
-	// Setup pins
+	// Setup keypad scanner and pins
+	setupKeypad();
 	setupMeasurement();
 	// Setup LCD
-	lcd.begin(16, 2);
-	lcd.clear();
+	setupLcd();
 
 
 	// usblag initialization
@@ -157,6 +183,8 @@ void setup() {
 #endif
 		Error(F("Error:"), F("USB problem!!!"));
 	}
+	if (!addTask(usbTask, 0))
+		Error(F("Error:"), F("Too many tasks"));
 	delay(200);
 
 	// Start in Lagmeter mode
@@ -188,6 +216,71 @@ void setup() {
 }
 
 
+// Entries of the LagMeter menu (KEY_MENU).
+enum {
+	MENU_TEST_PHOTO_BUTTON,
+	MENU_WAVEFORM_PHOTO,
+	MENU_WAVEFORM_AD2,
+	MENU_RESPONSE_TIME,
+	MENU_REFRESH_AD2,
+	MENU_REFRESH_PHOTO,
+	MENU_POLL_PERIOD,
+	MENU_SELF_TEST_RELAY,
+	MENU_SELF_TEST_SOLID_STATE,
+	MENU_ACTUATOR_TYPE,
+	MENU_COUNT
+};
+
+
+// Shows the LagMeter menu and starts the chosen test.
+void handleLagMeterMenu() {
+	const __FlashStringHelper* const entries[MENU_COUNT] = {
+		F("Button ON/OFF"),
+		F("Wave: Photo"),
+		F("Wave: AD2"),
+		F("Response time"),
+		F("Refresh: AD2"),
+		F("Refresh: Photo"),
+		F("Poll period"),
+		F("Self-test: Relay"),
+		F("Self-test: SSR"),
+		F("Actuator type"),
+	};
+	switch (selectMenu(entries, MENU_COUNT)) {
+	case MENU_TEST_PHOTO_BUTTON:
+		testPhotoSensor();
+		break;
+	case MENU_WAVEFORM_PHOTO:
+		measureWaveform(IN_PIN_PHOTO_SENSOR);
+		break;
+	case MENU_WAVEFORM_AD2:
+		measureWaveform(IN_PIN_SVGA);
+		break;
+	case MENU_RESPONSE_TIME:
+		measureResponseTime();
+		break;
+	case MENU_REFRESH_AD2:
+		measureRefreshRate(IN_PIN_SVGA);
+		break;
+	case MENU_REFRESH_PHOTO:
+		measureRefreshRate(IN_PIN_PHOTO_SENSOR);
+		break;
+	case MENU_POLL_PERIOD:
+		measurePollPeriod();
+		break;
+	case MENU_SELF_TEST_RELAY:
+		measureActuator(ACTUATOR_RELAY);
+		break;
+	case MENU_SELF_TEST_SOLID_STATE:
+		measureActuator(ACTUATOR_SOLID_STATE);
+		break;
+	case MENU_ACTUATOR_TYPE:
+		selectActuatorType();
+		break;
+	}
+}
+
+
 // Checks for keypresses for LagMeter mode.
 void handleLagMeter() {
 	// Check to print the menu
@@ -199,8 +292,8 @@ void handleLagMeter() {
 	// Handle user input
 	int key = getLcdKey();
 	switch (key) {
-	case KEY_TEST_PHOTO_BUTTON:
-		testPhotoSensor();
+	case KEY_MENU:
+		handleLagMeterMenu();
 		break;
 	case KEY_MEASURE_PHOTO:
 		measurePhotoSensor();
@@ -246,9 +339,9 @@ void usblagTestButton() {
 			lcd.print(F("OFF"));
 
 		// Wait for some time
-		for (int i = 0; i < 1500; i++) {
-			delay(1); // wait 1ms
-			Usb.Task();
+		unsigned long startTime = millis();
+		while (millis() - startTime < 1500) {
+			runTasks();
 			printJoystickButtonChanged();
 			if (isUsbAbort()) break;
 		}
@@ -260,8 +353,8 @@ void usblagTestButton() {
 
 
 // Measures the usb lag. I.e. the time from button press to received USB reaction.
-// Returns the time in milli seconds.
-double measureUsbLag() {
+// Returns the time in timebase ticks (0 on error or abort).
+uint32_t measureUsbLag() {
 	// Handle USB a few times just in case
 	Usb.Task();
 	Usb.Task();
@@ -269,30 +362,42 @@ double measureUsbLag() {
 	Usb.Task();
 
 	// "Press" button
+	// The tasks (e.g. the LCD update) are suspended while the time is measured,
+	// USB is polled directly. The keypad scanner keeps running, i.e. the
+	// window can be aborted with a key. Therefore the time is latched
+	// right after Usb.Task().
 	joystickButtonPressed = false;
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
+	suspendTasks(true);
+	startTimebase();
+	resetTimebaseWithButton(true);
 
 	// Wait until button press
-	long startTime = micros();
-	long diffTime = 0;
+	const uint32_t timeout = usToTicks(1000000l);
+	uint32_t ticks = 0;
 	while (!joystickButtonPressed) {
 		Usb.Task();
-		if (isUsbAbort()) return;
-		// Stop measuring
-		long stopTime = micros();
-		diffTime = stopTime - startTime;
+		// Stop measuring. Latched before the abort check: the keypad
+		// scanner may run there (an ADC conversion of about 100us).
+		ticks = getTimebase();
+		if (isUsbAbort()) {
+			stopTimebase();
+			suspendTasks(false);
+			return 0;
+		}
 
 		// Check if too long
-		if (diffTime > 1000000l) {
+		if (ticks > timeout) {
 			// More than a second
+			stopTimebase();
+			suspendTasks(false);
 			Error(F("Error:"), F("No response!"));
 			return 0;
 		}
 	}
-
-	// Round
-	double time = diffTime / 1000.0; // ms
-	return time;
+	stopTimebase();
+	suspendTasks(false);
+	// Measure from the switching of the contact (see Actuator.h)
+	return compensateActuation(ticks);
 }
 
 
@@ -323,58 +428,54 @@ void usblagMeasure() {
 	// Initialize
 	digitalWrite(OUT_PIN_BUTTON, LOW);
 
-	// Calibrate, i.e. wait a small moment
-	lcd.clear();
-	lcd.print(F("Calibr. Don't"));
-	lcd.setCursor(0, 1);
-	lcd.print(F("touch joystick."));
-
-	setModeCalib(true);
-	bool output = true;
-	for (int i = 0; i < 1000; i++) {
-		// We need to stimulate the button otherwise nothing is reported
-		digitalWrite(OUT_PIN_BUTTON, output);
-		output = !output;
-		Usb.Task();
-		waitMs(2);
-		if (isUsbAbort()) {
-			setModeCalib(false);
+	// Calibrate, i.e. find the bits of the button in the HID report
+	// (not needed for xbox, the buttons are decoded)
+	if (!xboxMode) {
+		lcd.clear();
+		lcd.print(F("Calibr. Don't"));
+		lcd.setCursor(0, 1);
+		lcd.print(F("touch joystick."));
+		bool found = calibrateJoystickButton();
+		if (isUsbAbort()) return;
+		if (!found) {
+			Error(F("Calibration:"), F("No button found"));
 			return;
 		}
 	}
-	digitalWrite(OUT_PIN_BUTTON, LOW);
-	waitMs(100);
-	Usb.Task();
-	Usb.Task();
-	setModeCalib(false);
 
 	lcd.clear();
 	struct MinMaxFloat timeRange = { 100000 /* 100 sec */, 0 };
-	float avg = 0.0;
+	streamRunStart(STREAM_MODE_USB);
+	resetSamplingStats();	// Not sampled, the run end reports 0 samples
+	resetPollStats();
+	startStimulusSchedule();
+	// The poll interval if known (not for xbox), otherwise the frame period (0 = random phases)
+	unsigned long pollPeriod = (usedPollInterval > 0) ? usedPollInterval * 1000l : getStimulusPeriod();
+	Statistics stats;
+	Histogram histogram(100);	// 0.1ms bins
 	for (int i = 1; i <= COUNT_CYCLES; i++) {
-		// Print
+		// Print (to the LCD buffer, written to the display by the waits)
 		lcd.setCursor(0, 0);
-		Usb.Task();
 		lcd.print(i);
-		Usb.Task();
 		lcd.print(F("/"));
-		Usb.Task();
 		lcd.print(COUNT_CYCLES);
-		Usb.Task();
 		lcd.print(F(": "));
-		Usb.Task();
 
-		// Wait a random time to make sure we really get different results.
-		uint8_t waitRnd = random(70, 150);
-		for (uint8_t i = 0; i < waitRnd; i++) {
-			delay(1);
+		// Wait until the next press. The press is shifted in phase relative
+		// to the USB poll interval to make sure we really get different results.
+		unsigned long waitTime = getNextStimulusDelay(pollPeriod);
+		unsigned long waitStartTime = micros();
+		while (micros() - waitStartTime < waitTime) {
 			if (isUsbAbort()) return;
 			Usb.Task();
+			pumpResultStream();
 		}
 
 		// Measure lag
-		double time = measureUsbLag();  // in 0.1 ms resolution
+		uint32_t ticks = measureUsbLag();
 		if (isUsbAbort()) return;
+		streamCycle(STREAM_MODE_USB, i, ticks, 0, 0, true);
+		double time = ticksToUs(ticks) / 1000.0;  // in ms
 
 #if 0
 		for (uint16_t i = 0;i < 1000;i++) {
@@ -392,9 +493,7 @@ void usblagMeasure() {
 		// Output result:
 		dtostrf(time, 1, 1, buffer);
 		lcd.print(buffer);
-		Usb.Task();
 		lcd.print(F("ms     "));
-		Usb.Task();
 
 		// Calculate max/min.
 		if (time > timeRange.max)
@@ -413,8 +512,9 @@ void usblagMeasure() {
 		lcd.print(buffer);
 		lcd.print(F("ms     "));
 
-		// Calculate average
-		avg += time;
+		// Calculate average and distribution
+		stats.add((long)(time * 1000.0));
+		histogram.add((long)(time * 1000.0));
 
 		// "Release" button
 		digitalWrite(OUT_PIN_BUTTON, LOW);
@@ -433,22 +533,175 @@ void usblagMeasure() {
 				return;
 			}
 			Usb.Task();
+			pumpResultStream();
+		}
+
+		// Stop if the average is exact enough
+		if (stats.isConverged(MIN_COUNT_CYCLES, CI_TARGET_WIDTH))
+			break;
+	}
+
+	streamRunEnd(STREAM_MODE_USB, stats.getCount());
+	serialPrintPercentiles(histogram);
+	serialPrintPollStats();
+
+	// Show the results until a key is pressed:
+	// Average and min/max, the percentiles, the number of cycles,
+	// the timing of the polls (not for xbox) and the lag in frames
+	// if the frame period is known.
+	uint8_t page = 0;
+	while (true) {
+		if (page == 1) {
+			printPercentiles(histogram);
+		}
+		else if (page == 2) {
+			printConfidence(stats);
 		}
+		else if (page == 3) {
+			printPollStats();
+		}
+		else if (page == 4) {
+			printFrames(stats);
+		}
+		else {
+			lcd.clear();
+			lcd.print(F("Avg lag: "));
+			dtostrf(stats.getMean() / 1000.0, 1, 1, buffer);
+			lcd.print(buffer);
+			lcd.print(F("ms"));
+			lcd.setCursor(4, 1);
+			if (timeRange.min != timeRange.max) {
+				dtostrf(timeRange.min, 1, 1, buffer);
+				lcd.print(buffer);
+				lcd.print(F("-"));
+			}
+			dtostrf(timeRange.max, 1, 1, buffer);
+			lcd.print(buffer);
+			lcd.print(F("ms"));
+		}
+
+		// Wait until keypress
+		waitMs(RESULT_PAGE_TIME); if (isUsbAbort()) return;
+		// Next page, skip the pages that are not available
+		do {
+			page = (page + 1) % 5;
+		} while ((page == 3 && xboxMode) || (page == 4 && getFramePeriod() <= 0.0));
+	}
+}
+
+// Prints the interval histogram of the report interval analyzer to serial.
+void serialPrintReportIntervals() {
+#ifdef SERIAL_IF_ENABLED
+	Serial.print(F("Reports\tNAKs\terrors\tinterval min\tmean\tmax (us):\t"));
+	Serial.print(reportIntervals.reports);
+	Serial.print(F("\t"));
+	Serial.print(reportIntervals.naks);
+	Serial.print(F("\t"));
+	Serial.print(reportIntervals.errors);
+	Serial.print(F("\t"));
+	Serial.print((reportIntervals.reports > 1) ? reportIntervals.minInterval : 0);
+	Serial.print(F("\t"));
+	Serial.print(reportIntervals.GetMeanInterval());
+	Serial.print(F("\t"));
+	Serial.println(reportIntervals.maxInterval);
+	Serial.println(F("Interval (us)\tcount"));
+	for (uint8_t i = 0; i <= REPORT_INTERVAL_BINS; i++) {
+		if (reportIntervals.bins[i] == 0)
+			continue;
+		if (i == REPORT_INTERVAL_BINS)
+			Serial.print(F(">"));
+		Serial.print((uint32_t)i * REPORT_INTERVAL_BIN_WIDTH);
+		Serial.print(F("\t"));
+		Serial.println(reportIntervals.bins[i]);
 	}
+#endif
+}
 
-	// Print average:
-	avg /= COUNT_CYCLES;
-	lcd.setCursor(0, 0);
-	lcd.print(F("Avg lag: "));
-	dtostrf(avg, 1, 1, buffer);
+
+// Prints a time in us as ms with 3 decimals at the current cursor position.
+void printUsAsMs(uint32_t us) {
+	char buffer[10];
+	dtostrf(us / 1000.0, 1, 3, buffer);
 	lcd.print(buffer);
-	lcd.print(F("ms     "));
+	lcd.print(F("ms"));
+}
 
-	// Wait until keypress
-	while (!isUsbAbort()) {
-		delay(1);
-		Usb.Task();
+
+/*
+Report interval analyzer.
+Timestamps every completed interrupt IN transfer of the game controller and
+shows the real report rate (reports per second), the ratio of NAKed polls,
+the mean/min/max interval and the median and 95% percentile of the intervals.
+The values are updated until a key is pressed. A device that only sends a
+report on a change needs to be stimulated (e.g. move the stick).
+*/
+void usblagAnalyzeReports() {
+	char buffer[10];
+
+	// Show test title
+	lcd.clear();
+	lcd.print(F("Report"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("intervals"));
+	waitMs(TITLE_TIME); if (isUsbAbort()) return;
+
+	reportIntervals.Start(true);
+	lcd.clear();
+	lcd.print(F("Measuring..."));
+	uint8_t page = 0;
+	while (true) {
+		// Wait, USB is polled in the meantime
+		waitMs(RESULT_PAGE_TIME);
+		if (isUsbAbort())
+			break;
+
+		// Show the current values
+		lcd.clear();
+		uint32_t mean = reportIntervals.GetMeanInterval();
+		if (mean == 0) {
+			lcd.print(F("No reports"));
+		}
+		else if (page == 1) {
+			lcd.print(F("Int: "));
+			printUsAsMs(mean);
+			lcd.setCursor(0, 1);
+			dtostrf(reportIntervals.minInterval / 1000.0, 1, 1, buffer);
+			lcd.print(buffer);
+			lcd.print(F("-"));
+			dtostrf(reportIntervals.maxInterval / 1000.0, 1, 1, buffer);
+			lcd.print(buffer);
+			lcd.print(F("ms"));
+		}
+		else if (page == 2) {
+			lcd.print(F("50%: "));
+			printUsAsMs(reportIntervals.GetPercentile(50));
+			lcd.setCursor(0, 1);
+			lcd.print(F("95%: "));
+			printUsAsMs(reportIntervals.GetPercentile(95));
+		}
+		else {
+			uint32_t polls = reportIntervals.reports + reportIntervals.naks + reportIntervals.errors;
+			lcd.print(F("Rep/s: "));
+			dtostrf(1000000.0 / mean, 1, 1, buffer);
+			lcd.print(buffer);
+			lcd.setCursor(0, 1);
+			lcd.print(F("NAK: "));
+			if (xboxMode) {
+				// The xbox is polled on every Usb.Task() (no interval), i.e.
+				// the ratio depends on the speed of the loop, not the device
+				lcd.print(F("- (xbox)"));
+			}
+			else {
+				dtostrf(100.0 * reportIntervals.naks / polls, 1, 1, buffer);
+				lcd.print(buffer);
+				lcd.print(F("%"));
+			}
+		}
+		page = (page + 1) % 3;
 	}
+
+	serialPrintReportIntervals();
+	reportIntervals.Start(false);
 }
 
 // Checks for keypresses for usblag mode.
@@ -475,13 +728,21 @@ void handleUsblag() {
 		abortAll = false;
 		break;
 
+	case KEY_USBLAG_ANALYZE:
+		// Measure the real report intervals of the device
+		usblagAnalyzeReports();
+		printUsblagMenu();
+		joystickButtonChanged = false;
+		abortAll = false;
+		break;
+
 	case KEY_USBLAG_MEASURE_1MS:
 		if (xboxMode) {
 			// Not available in xbox mode
 			lcd.clear();
 			lcd.print(F("Not available."));
 			while (!isUsbAbort())
-				delay(100);
+				runTasks();
 			printUsblagMenu();
 			joystickButtonChanged = false;
 			abortAll = false;
@@ -532,6 +793,6 @@ void loop() {
 	}
 #endif
 
-	// Handle USB
-	Usb.Task();
+	// Handle USB, keypad, result stream
+	runTasks();
 }
@@ -3,64 +3,149 @@
 // Max values to observe.
 #define MAX_VALUES  64
 
+// Calibration: Max. time of one stimulus phase (press or release) in ms.
+#define CALIB_PHASE_TIMEOUT  100
+// Calibration: Number of press/release cycles the bits need to follow the stimulus unchanged.
+#define CALIB_MIN_CYCLES  5
+// Calibration: Max. number of stimulus phases.
+#define CALIB_MAX_PHASES  100
+
 
 class JoystickReportParser : public HIDReportParser {
 protected:
 	uint8_t lastReportedValues[MAX_VALUES] = { 0 };
-	uint16_t counts[MAX_VALUES];
+	uint8_t releasedValues[MAX_VALUES] = { 0 };	// The report with released button
+	uint8_t candidates[MAX_VALUES];	// The bits that followed the stimulus so far
 	uint8_t measureIndex = 0;
+	uint8_t measureMask = 0xFF;
 	unsigned long startTime = 0;
 	const uint8_t startIndex = 0; //5;
 	bool calibrationMode = false;
+	bool calibPress = false;	// The current stimulus
+	bool calibRestart = true;	// The released values need to be (re-)taken
+	bool calibPhaseDone = false;
+	uint8_t calibCycles = 0;
+
+	// Returns the number of set bits.
+	static uint8_t countBits(uint8_t bits) {
+		uint8_t count = 0;
+		for (; bits; bits &= bits - 1)
+			count++;
+		return count;
+	}
 
 public:
-	JoystickReportParser::JoystickReportParser() {
+	JoystickReportParser() {
 	}
 
 
 	/**
 	 * Sets the parse mode.
-	 * @param calib true = calibration mode: counts the number of changes per byte
-	 * false = sets joystickButtonPressed if the byte with the right index changed.
+	 * @param calib true = calibration mode: finds the bits that follow the stimulus,
+	 * see StartCalibPhase() and EndCalibPhase().
+	 * false = sets joystickButtonPressed if one of the calibrated bits differs from the released value.
 	 */
-	void JoystickReportParser::SetModeCalib(bool calib) {
+	void SetModeCalib(bool calib) {
 		calibrationMode = calib;
 		if (calibrationMode) {
 			// Calibration mode
-			memset(counts, 0, sizeof(uint16_t) * MAX_VALUES);
+			calibRestart = true;
+			calibPhaseDone = false;
 			measureIndex = 0;
+			measureMask = 0xFF;
 		}
 		else {
 			// Normal measurement mode
-			// Calculate max count index
-			uint16_t maxCount = 0;
-			measureIndex = 0;
-			//Serial.println(F("counts[]:"));
-			for (uint8_t i = 0; i < MAX_VALUES; i++) {
-				//SerialPrintHex<uint8_t>(counts[i]);
-				//Serial.print(F(", "));
-				if (counts[i] > maxCount) {
-					maxCount = counts[i];
-					measureIndex = i;
+			// Use the first byte with remaining candidates
+			if (!calibRestart) {
+				for (uint8_t i = 0; i < MAX_VALUES; i++) {
+					if (candidates[i]) {
+						measureIndex = i;
+						measureMask = candidates[i];
+						break;
+					}
 				}
 			}
-			//Serial.println();
-#if 0
-			Serial.print("measureIndex=");
-			Serial.println(measureIndex);
-			Serial.print("maxCount=");
-			Serial.println(maxCount);
-			Serial.print("lastReportedValues[measureIndex] = ");
-			Serial.println(lastReportedValues[measureIndex]);
+#ifdef SERIAL_IF_ENABLED
+			Serial.print(F("Calibration: index\tmask\tcycles:\t"));
+			Serial.print(measureIndex);
+			Serial.print(F("\t0x"));
+			Serial.print(measureMask, HEX);
+			Serial.print(F("\t"));
+			Serial.println(calibCycles);
 #endif
 		}
 	}
 
 
+	/**
+	 * Starts a phase of the calibration.
+	 * The button needs to be switched before.
+	 * @param press true if the button has been pressed, false if released.
+	 */
+	void StartCalibPhase(bool press) {
+		calibPress = press;
+		calibPhaseDone = false;
+	}
+
+
+	/**
+	 * @return true if all candidate bits have followed the stimulus of the phase.
+	 */
+	bool IsCalibPhaseDone() {
+		return calibPhaseDone;
+	}
+
+
+	/**
+	 * Ends a phase of the calibration: Removes the candidate bits that did
+	 * not follow the stimulus, i.e. that equal the released value while
+	 * pressed or differ from it while released.
+	 * If no candidate is left the calibration is restarted with the next
+	 * release.
+	 * Several bits may remain, e.g. if the button is also reported as
+	 * a separate bit. They are all used for the measurement.
+	 * @return true if the candidates did not change for CALIB_MIN_CYCLES cycles.
+	 */
+	bool EndCalibPhase() {
+		if (calibRestart) {
+			// Take the released values, all bits are candidates
+			if (!calibPress) {
+				memcpy(releasedValues, lastReportedValues, MAX_VALUES);
+				memset(candidates, 0xFF, MAX_VALUES);
+				calibCycles = 0;
+				calibRestart = false;
+			}
+			return false;
+		}
+
+		uint8_t count = 0;
+		bool changed = false;
+		for (uint8_t i = 0; i < MAX_VALUES; i++) {
+			uint8_t bits = lastReportedValues[i] ^ releasedValues[i];
+			uint8_t remaining = candidates[i] & ((calibPress) ? bits : ~bits);
+			if (remaining != candidates[i])
+				changed = true;
+			candidates[i] = remaining;
+			count += countBits(remaining);
+		}
+		if (count == 0) {
+			calibRestart = true;
+			return false;
+		}
+		if (changed)
+			calibCycles = 0;
+		if (calibPress)
+			return false;
+		calibCycles++;
+		return (calibCycles >= CALIB_MIN_CYCLES);
+	}
+
+
 	/**
 	 * Called whenever a USB packet has been received.
 	 */
-	void JoystickReportParser::Parse(USBHID* hid, bool is_rpt_id, uint8_t len, uint8_t* buf) {
+	void Parse(USBHID* hid, bool is_rpt_id, uint8_t len, uint8_t* buf) {
 		if (calibrationMode)
 			ParseCalib(len, buf);
 		else
@@ -70,10 +155,10 @@ public:
 
 	/**
 	 * Parses for calibration.
-	 * For each byte (index) it counts the number of changes.
-	 * At the end the index with the highest number is used for ParseMeasurement().
+	 * Remembers the report and checks if all candidate bits follow the
+	 * stimulus, i.e. if the phase can be ended early.
 	 */
-	void JoystickReportParser::ParseCalib(uint8_t len, uint8_t* buf) {
+	void ParseCalib(uint8_t len, uint8_t* buf) {
 #if 0
 		// Print
 		for (uint8_t i = 0; i < len; i++) {
@@ -86,32 +171,29 @@ public:
 		// Safety check
 		uint8_t count = min(MAX_VALUES, len);
 
-		// Check and copy
+		// Remember the values
+		memcpy(lastReportedValues, buf, count);
+
+		// The released values are taken at the end of the phase
+		// (a report sent before the release may still arrive).
+		if (calibRestart)
+			return;
+
+		// Check that all candidates follow the stimulus
 		for (uint8_t i = 0; i < count; i++) {
-			uint8_t bits = buf[i] ^ lastReportedValues[i]; // Is 0 if equal
-			// Now check that only 1 bit is set (i.e. ignore e.g. axis changes which probably often set more than one bit)
-			if (bits && !(bits & (bits - 1))) {
-				counts[i]++; // Increase count
-#if 0
-				Serial.print("i=");
-				Serial.print(i);
-				Serial.print(", counts[i]=");
-				Serial.println(counts[i]);
-#endif
-			}
-			// In any case remember the value
-			lastReportedValues[i] = buf[i];
-			//Serial.print(buf[i]);
-			//Serial.print(F(", "));
+			uint8_t bits = (buf[i] ^ releasedValues[i]) & candidates[i];
+			if (bits != ((calibPress) ? candidates[i] : 0))
+				return;
 		}
-		//Serial.println();
+		calibPhaseDone = true;
 	}
 
 	/**
 	 * Parses for mesurement.
-	 * The byte with index, calibIndex, is checked for changes.
+	 * The calibrated bits (measureIndex, measureMask) are compared with the
+	 * released values. Other bits of the byte (e.g. a hat or an axis) are ignored.
 	 */
-	void JoystickReportParser::ParseMeasure(uint8_t len, uint8_t* buf) {
+	void ParseMeasure(uint8_t len, uint8_t* buf) {
 #if 0
 		// Print
 		for (uint8_t i = 0; i < len; i++) {
@@ -141,7 +223,7 @@ public:
 		}
 
 		// Check if "button press"
-		joystickButtonPressed = (buf[measureIndex] != lastReportedValues[measureIndex]);
+		joystickButtonPressed = (((buf[measureIndex] ^ releasedValues[measureIndex]) & measureMask) != 0);
 
 #if 0
 		Serial.print("buf[measureIndex] = ");
@@ -217,12 +299,36 @@ UsbHidJoystick Hid(&Usb);
 
 
 /**
- * Sets the parse mode.
- * @param calib true = calibration mode: counts the number of changes per byte
- * false = sets joystickButtonPressed if the byte with the right index changed.
+ * Calibration: Finds the bits of the HID report that follow the button.
+ * The button is pressed and released until the set of bits that follow
+ * the stimulus has not changed for CALIB_MIN_CYCLES cycles. A phase ends
+ * as soon as all remaining candidate bits have changed (or after
+ * CALIB_PHASE_TIMEOUT).
+ * The measurement tests only these bits afterwards (of the first byte
+ * that contains any).
+ * @return false if no bit was found or on abort.
  */
-void setModeCalib(bool calib) {
-	HidJoyParser.SetModeCalib(calib);
+bool calibrateJoystickButton() {
+	HidJoyParser.SetModeCalib(true);
+	bool found = false;
+	// Start with a released phase to get the released values
+	for (uint8_t i = 0; i < CALIB_MAX_PHASES && !found; i++) {
+		bool press = (i & 1);
+		setButton(press);
+		HidJoyParser.StartCalibPhase(press);
+		unsigned long startTime = millis();
+		while (!HidJoyParser.IsCalibPhaseDone() && millis() - startTime < CALIB_PHASE_TIMEOUT) {
+			waitMs(1);	// USB is polled in the meantime
+			if (isUsbAbort())
+				break;
+		}
+		if (isUsbAbort())
+			break;
+		found = HidJoyParser.EndCalibPhase();
+	}
+	setButton(false);
+	HidJoyParser.SetModeCalib(false);
+	return found;
 }
 
 
@@ -232,3 +338,60 @@ void setPollInterval(int pollInterval) {
 	Usb.Task();
 	Usb.Task();
 }
+
+
+// Resets the timing statistics of the polls.
+void resetPollStats() {
+	Hid.ResetPollStats();
+}
+
+
+// Prints the timing of the polls since resetPollStats() to the LCD:
+// The average poll interval and the average/max delay of the polls
+// after their deadline. If deadlines were missed the number is shown
+// after the interval ("M").
+void printPollStats() {
+	const ModifiedHIDUniversal::PollStats& stats = Hid.GetPollStats();
+	char buffer[10];
+	lcd.clear();
+	lcd.print(F("Poll: "));
+	if (stats.polls < 2) {
+		lcd.print(F("-"));
+		return;
+	}
+	dtostrf(stats.sumInterval / 1000.0 / (stats.polls - 1), 1, 3, buffer);
+	lcd.print(buffer);
+	lcd.print(F("ms"));
+	if (stats.missed > 0) {
+		lcd.print(F(" M"));
+		lcd.print(stats.missed);
+	}
+	lcd.setCursor(0, 1);
+	lcd.print(F("Late: "));
+	lcd.print(stats.sumLate / stats.polls);
+	lcd.print(F("/"));
+	lcd.print(stats.maxLate);
+	lcd.print(F("us"));
+}
+
+
+// Prints the timing of the polls to serial.
+void serialPrintPollStats() {
+#ifdef SERIAL_IF_ENABLED
+	const ModifiedHIDUniversal::PollStats& stats = Hid.GetPollStats();
+	Serial.print(F("Polls\tmissed\tinterval min\tmean\tmax\tlate mean\tmax (us):\t"));
+	Serial.print(stats.polls);
+	Serial.print(F("\t"));
+	Serial.print(stats.missed);
+	Serial.print(F("\t"));
+	Serial.print(stats.minInterval);
+	Serial.print(F("\t"));
+	Serial.print((stats.polls > 1) ? stats.sumInterval / (stats.polls - 1) : 0);
+	Serial.print(F("\t"));
+	Serial.print(stats.maxInterval);
+	Serial.print(F("\t"));
+	Serial.print((stats.polls > 0) ? stats.sumLate / stats.polls : 0);
+	Serial.print(F("\t"));
+	Serial.println(stats.maxLate);
+#endif
+}
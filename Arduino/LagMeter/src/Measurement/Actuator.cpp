@@ -0,0 +1,286 @@
+#include "Actuator.h"
+#include "Utilities.h"
+#include "Common.h"
+#include "Timebase.h"
+#include "Button.h"
+#include "Statistics.h"
+#include <EEPROM.h>
+
+
+// Number of presses (and releases) of the self-test.
+#define ACTUATOR_TEST_CYCLES  50
+// The contact has settled if there was no edge for this time (in us).
+#define ACTUATOR_SETTLE_TIME  2000
+// Max. time to wait for the contact (in us).
+#define ACTUATOR_TIMEOUT  20000
+// Wait time between 2 switchings (in ms, random in this range).
+#define ACTUATOR_MIN_WAIT  20
+#define ACTUATOR_MAX_WAIT  40
+
+// Marks a valid cache in EEPROM.
+#define ACTUATOR_CACHE_MAGIC  0xAC01
+
+
+// The result of the self-test of one actuator type.
+struct ActuatorCalibration {
+	bool valid;
+	uint16_t pressDelay;    // Mean delay from the output to the first edge of the contact (ticks)
+	uint16_t releaseDelay;
+	uint16_t maxBounce;     // Max. time from the first to the last edge (ticks)
+};
+
+// The actuator settings, stored in EEPROM at EEPROM_ADDR_ACTUATOR.
+struct ActuatorCache {
+	uint16_t magic;
+	uint8_t type;           // The used actuator
+	struct ActuatorCalibration calib[ACTUATOR_COUNT];
+};
+
+static struct ActuatorCache actuator;
+
+// Set by the INT0 interrupt.
+static volatile uint8_t loopbackEdges;
+static volatile uint32_t loopbackFirstTime;
+static volatile uint32_t loopbackLastTime;
+
+
+// Timestamps each edge of the contact.
+ISR(INT0_vect) {
+	uint32_t time = extendTimebase(TCNT1);
+	if (loopbackEdges == 0)
+		loopbackFirstTime = time;
+	loopbackLastTime = time;
+	if (loopbackEdges < 0xFF)
+		loopbackEdges++;
+}
+
+
+// Initializes the loopback input and reads the settings from EEPROM.
+void setupActuator() {
+	pinMode(IN_PIN_LOOPBACK, INPUT_PULLUP);
+	EICRA = (EICRA & ~((1 << ISC01) | (1 << ISC00))) | (1 << ISC00);	// Any change
+	EEPROM.get(EEPROM_ADDR_ACTUATOR, actuator);
+	if (actuator.magic != ACTUATOR_CACHE_MAGIC || actuator.type >= ACTUATOR_COUNT) {
+		memset(&actuator, 0, sizeof(actuator));
+		actuator.magic = ACTUATOR_CACHE_MAGIC;
+		actuator.type = ACTUATOR_RELAY;
+	}
+}
+
+
+// Returns the used actuator type.
+uint8_t getActuatorType() {
+	return actuator.type;
+}
+
+
+// Sets the used actuator type and stores it in EEPROM.
+// @param type ACTUATOR_RELAY or ACTUATOR_SOLID_STATE.
+void setActuatorType(uint8_t type) {
+	actuator.type = type;
+	EEPROM.put(EEPROM_ADDR_ACTUATOR, actuator);
+}
+
+
+// Subtracts the delay of the used actuator from a time measured since
+// the output was switched. Nothing is subtracted if the actuator
+// has not been measured.
+// @param ticks The time since the output was switched (timebase ticks).
+// @param press true if the button was pressed, false if released.
+// @return The time since the contact was switched.
+uint32_t compensateActuation(uint32_t ticks, bool press) {
+	const struct ActuatorCalibration& calib = actuator.calib[actuator.type];
+	if (!calib.valid)
+		return ticks;
+	uint16_t delayTicks = (press) ? calib.pressDelay : calib.releaseDelay;
+	if (ticks < delayTicks)
+		return 0;
+	return ticks - delayTicks;
+}
+
+
+// Prints the name of an actuator type.
+static void printActuatorType(uint8_t type) {
+	if (type == ACTUATOR_SOLID_STATE)
+		lcd.print(F("Solid state"));
+	else
+		lcd.print(F("Relay"));
+}
+
+
+// Switches the output and timestamps the edges of the contact
+// until it has settled.
+// @param press true to press the button, false to release.
+// @param delayTicks Returns the time until the first edge (ticks).
+// @param bounceTicks Returns the time from the first to the last edge (ticks).
+// @return false if the contact did not switch.
+static bool captureActuation(bool press, uint16_t& delayTicks, uint16_t& bounceTicks) {
+	const uint32_t settle = usToTicks(ACTUATOR_SETTLE_TIME);
+	const uint32_t timeout = usToTicks(ACTUATOR_TIMEOUT);
+	uint8_t edges;
+	uint32_t firstTime;
+	uint32_t lastTime;
+
+	startTimebase();
+	loopbackEdges = 0;
+	EIFR = 1 << INTF0;  // Clear pending bit
+	EIMSK |= 1 << INT0;
+
+	// Switch the output and reset timer
+	resetTimebaseWithButton(press);
+
+	while (true) {
+		uint32_t now = getTimebase();
+		noInterrupts();
+		edges = loopbackEdges;
+		firstTime = loopbackFirstTime;
+		lastTime = loopbackLastTime;
+		interrupts();
+		if (edges > 0 && now - lastTime >= settle)
+			break;
+		if (now >= timeout)
+			break;
+	}
+
+	EIMSK &= ~(1 << INT0);
+	stopTimebase();
+
+	// The contact closes to GND
+	bool closed = (digitalRead(IN_PIN_LOOPBACK) == LOW);
+	if (edges == 0 || closed != press)
+		return false;
+	delayTicks = firstTime;
+	bounceTicks = lastTime - firstTime;
+	return true;
+}
+
+
+// Self-test: Measures the delay and bounce of the actuator.
+// The switched contact needs to be connected to IN_PIN_LOOPBACK and GND.
+// The result is stored in EEPROM and the type is used from now on.
+// @param type ACTUATOR_RELAY or ACTUATOR_SOLID_STATE.
+void measureActuator(uint8_t type) {
+	// Show test title
+	lcd.clear();
+	lcd.print(F("Self-test:"));
+	lcd.setCursor(0, 1);
+	printActuatorType(type);
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+	// Check the loopback
+	setButton(false);
+	waitMs(ACTUATOR_MAX_WAIT); if (isAbort()) return;
+	if (digitalRead(IN_PIN_LOOPBACK) == LOW) {
+		Error(F("Self-test:"), F("Check loopback"));
+		return;
+	}
+
+	Statistics pressStats;
+	Statistics releaseStats;
+	Statistics bounceStats;
+	lcd.clear();
+	lcd.print(F("Measuring..."));
+	for (int i = 0; i < ACTUATOR_TEST_CYCLES; i++) {
+		uint16_t delays[2];
+		uint16_t bounces[2];
+		for (uint8_t k = 0; k < 2; k++) {
+			bool press = (k == 0);
+			if (!captureActuation(press, delays[k], bounces[k])) {
+				setButton(false);
+				Error(F("Self-test:"), F("No contact"));
+				return;
+			}
+			waitMs(random(ACTUATOR_MIN_WAIT, ACTUATOR_MAX_WAIT)); if (isAbort()) return;
+		}
+		pressStats.add(ticksToUs(delays[0]));
+		releaseStats.add(ticksToUs(delays[1]));
+		bounceStats.add(ticksToUs(bounces[0]));
+		bounceStats.add(ticksToUs(bounces[1]));
+
+		lcd.setCursor(0, 1);
+		lcd.print(i + 1);
+
+#ifdef SERIAL_IF_ENABLED
+		Serial.print(F("Actuator (us) press/bounce/release/bounce:\t"));
+		Serial.print(ticksToUs(delays[0]));
+		Serial.print(F("\t"));
+		Serial.print(ticksToUs(bounces[0]));
+		Serial.print(F("\t"));
+		Serial.print(ticksToUs(delays[1]));
+		Serial.print(F("\t"));
+		Serial.println(ticksToUs(bounces[1]));
+#endif
+	}
+
+	// Store
+	struct ActuatorCalibration& calib = actuator.calib[type];
+	calib.valid = true;
+	calib.pressDelay = usToTicks((unsigned long)(pressStats.getMean() + 0.5));
+	calib.releaseDelay = usToTicks((unsigned long)(releaseStats.getMean() + 0.5));
+	calib.maxBounce = usToTicks(bounceStats.getMax());
+	setActuatorType(type);
+
+	// Show the results until a key is pressed:
+	// The press and release delay (mean and min-max) and the bounce.
+	uint8_t page = 0;
+	while (true) {
+		lcd.clear();
+		if (page < 2) {
+			const Statistics& stats = (page == 0) ? pressStats : releaseStats;
+			if (page == 0)
+				lcd.print(F("Press: "));
+			else
+				lcd.print(F("Release: "));
+			lcd.print((long)(stats.getMean() + 0.5));
+			lcd.print(F("us"));
+			lcd.setCursor(0, 1);
+			lcd.print(stats.getMin());
+			lcd.print(F("-"));
+			lcd.print(stats.getMax());
+			lcd.print(F("us"));
+		}
+		else {
+			lcd.print(F("Bounce: "));
+			lcd.print((long)(bounceStats.getMean() + 0.5));
+			lcd.print(F("us"));
+			lcd.setCursor(0, 1);
+			lcd.print(F("Max: "));
+			lcd.print(bounceStats.getMax());
+			lcd.print(F("us"));
+		}
+		waitMs(RESULT_PAGE_TIME); if (isAbort()) return;
+		page = (page + 1) % 3;
+	}
+}
+
+
+// Shows a menu to select the used actuator type.
+// The current type and the measured press delay and max. bounce
+// are shown first.
+void selectActuatorType() {
+	lcd.clear();
+	printActuatorType(actuator.type);
+	lcd.setCursor(0, 1);
+	const struct ActuatorCalibration& calib = actuator.calib[actuator.type];
+	if (calib.valid) {
+		lcd.print(F("Dly:"));
+		lcd.print(ticksToUs(calib.pressDelay));
+		lcd.print(F("us B:"));
+		lcd.print(ticksToUs(calib.maxBounce));
+		lcd.print(F("us"));
+	}
+	else {
+		lcd.print(F("Not measured"));
+	}
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+	const __FlashStringHelper* const entries[ACTUATOR_COUNT] = {
+		F("Relay"),
+		F("Solid state"),
+	};
+	int type = selectMenu(entries, ACTUATOR_COUNT);
+	if (type < 0)
+		return;
+	setActuatorType(type);
+	abortAll = true;	// Back to the main menu
+}
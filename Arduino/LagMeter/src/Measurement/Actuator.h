@@ -0,0 +1,34 @@
+#ifndef __Actuator_H__
+#define __Actuator_H__
+
+#include <Arduino.h>
+
+
+// The button of the game controller is switched by an actuator at
+// OUT_PIN_BUTTON: a reed relay or a solid state switch (e.g. optocoupler
+// or MOSFET). The actuator adds a delay (relay: < 250us) and the relay
+// contact bounces (about 40us).
+// The self-test measures the actuator of the unit: The switched contact is
+// connected between IN_PIN_LOOPBACK (INT0, with pull-up) and GND instead
+// of the controller. Each edge of the contact is timestamped in the INT0
+// interrupt. The delay is the time from the output to the first edge, the
+// bounce the time from the first to the last edge.
+// The mean delays are stored in EEPROM for each actuator type and are
+// subtracted from the measured lag times of the selected type.
+
+// Actuator types.
+enum {
+	ACTUATOR_RELAY,
+	ACTUATOR_SOLID_STATE,
+	ACTUATOR_COUNT
+};
+
+
+void setupActuator();
+uint8_t getActuatorType();
+void setActuatorType(uint8_t type);
+uint32_t compensateActuation(uint32_t ticks, bool press = true);
+void measureActuator(uint8_t type);
+void selectActuatorType();
+
+#endif
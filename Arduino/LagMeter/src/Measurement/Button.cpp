@@ -0,0 +1,86 @@
+#include "Button.h"
+#include "Common.h"
+#include "Timebase.h"
+
+
+// The output register and the bit of OUT_PIN_BUTTON.
+static volatile uint8_t* buttonPort;
+static uint8_t buttonMask;
+// The time of the scheduled release (in ticks).
+static uint32_t buttonReleaseTicks;
+// Set by the compare match interrupt when the button has been released.
+static volatile bool buttonReleased;
+
+
+// Releases the button at the scheduled time.
+// The compare match happens every 65536 ticks, so the
+// (extended) time is checked as well.
+ISR(TIMER1_COMPA_vect) {
+	if (extendTimebase(TCNT1) < buttonReleaseTicks)
+		return;
+	*buttonPort &= ~buttonMask;
+	buttonReleased = true;
+	TIMSK1 &= ~(1 << OCIE1A);
+}
+
+
+// Initializes the button output (released).
+void setupButton() {
+	pinMode(OUT_PIN_BUTTON, OUTPUT);
+	buttonPort = portOutputRegister(digitalPinToPort(OUT_PIN_BUTTON));
+	buttonMask = digitalPinToBitMask(OUT_PIN_BUTTON);
+	setButton(false);
+}
+
+
+// Presses or releases the button.
+// @param press true to press the button.
+void setButton(bool press) {
+	uint8_t sreg = SREG;
+	noInterrupts();
+	if (press)
+		*buttonPort |= buttonMask;
+	else
+		*buttonPort &= ~buttonMask;
+	SREG = sreg;
+}
+
+
+// Presses or releases the button and resets the timebase to 0
+// without interruption, i.e. the time is measured from the edge.
+// @param press true to press the button.
+void resetTimebaseWithButton(bool press) {
+	uint8_t sreg = SREG;
+	noInterrupts();
+	setButton(press);
+	resetTimebase();
+	SREG = sreg;
+}
+
+
+// Releases the button at the given time. The timebase needs to be started.
+// Note: stopTimebase() disables the release. If it has not been
+// released until then the button needs to be released with setButton().
+// @param ticks The time of the release (since the reset of the timebase).
+void scheduleButtonRelease(uint32_t ticks) {
+	uint8_t sreg = SREG;
+	noInterrupts();
+	buttonReleaseTicks = ticks;
+	buttonReleased = false;
+	OCR1A = (uint16_t)ticks;
+	TIFR1 = 1 << OCF1A;  // Clear pending bit
+	TIMSK1 |= 1 << OCIE1A;
+	SREG = sreg;
+}
+
+
+// Cancels a scheduled release. The button is not changed.
+void cancelButtonRelease() {
+	TIMSK1 &= ~(1 << OCIE1A);
+}
+
+
+// @return true if the scheduled release has been done.
+bool isButtonReleased() {
+	return buttonReleased;
+}
@@ -0,0 +1,28 @@
+#ifndef __Button_H__
+#define __Button_H__
+
+#include <Arduino.h>
+
+
+// The simulated joystick button (OUT_PIN_BUTTON) is switched in sync with
+// the timebase (timer 1):
+// - The press is written directly to the port in the same critical section
+//   in which the timebase is reset, i.e. the press edge is at time 0
+//   (less than one tick before).
+// - The release is done by the timer 1 compare match A interrupt, i.e. it
+//   does not depend on the loop that evaluates the input.
+//   The edge follows the compare match by the constant interrupt latency
+//   (about 2us). It may be delayed by a few us more if the ADC interrupt
+//   is executed at the same time.
+// The hardware compare outputs cannot be used: OC1A (D9) and OC1B (D10)
+// are used by the USB host shield (INT and SS).
+
+
+void setupButton();
+void setButton(bool press);
+void resetTimebaseWithButton(bool press);
+void scheduleButtonRelease(uint32_t ticks);
+void cancelButtonRelease();
+bool isButtonReleased();
+
+#endif
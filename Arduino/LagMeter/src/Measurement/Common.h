@@ -14,16 +14,61 @@ const int IN_PIN_PHOTO_SENSOR = 2;
 
 // The analog input for the SVGA connector (blue, or red or green)
 const int IN_PIN_SVGA = 1;
+
+// Enable this to detect the threshold crossing with the analog comparator
+// and the input capture of timer 1 instead of sampling with the ADC.
+// Requires the RC low pass at AIN0 (see Comparator.h).
+// Measurements with a 2nd trigger (SVGA -> Photosensor) always use the ADC.
+//#define COMPARATOR_ENABLED
+
+// The PWM output for the comparator reference voltage (OC2B).
+const int OUT_PIN_COMPARATOR_REF = 3;
+
+// The analog input to check the comparator reference (connected to the RC low pass).
+// A3 is the RW pin of the LCD otherwise (see Utilities.cpp).
+const int IN_PIN_COMPARATOR_REF_SENSE = 3;
+
+// The input for the self-test of the actuator (see Actuator.h).
+// Needs to be INT0.
+const int IN_PIN_LOOPBACK = 2;
 ///////////////////////////////////////////////////////////////////
 
+// Enable this to get some additional output over serial port (especially for usblag).
+//#define SERIAL_IF_ENABLED
+
+// Enable this to stream the result of each cycle in binary form over
+// the serial port (see ResultStream.h). Can't be used together with SERIAL_IF_ENABLED.
+//#define RESULT_STREAM_ENABLED
+
 // Count of cycles to measure the input lag.
+// A run stops early as soon as the 95% confidence interval of the
+// average is smaller than CI_TARGET_WIDTH, but not before
+// MIN_COUNT_CYCLES. COUNT_CYCLES is the maximum.
+const int MIN_COUNT_CYCLES = 20;
 const int COUNT_CYCLES = 100;
+#define CI_TARGET_WIDTH  2000   // in us, i.e. the average is +-1ms exact
+
+// The button presses are spread over the period of the system under test
+// (see Stimulus.h). If the period is not known the phase offsets are random,
+// the sum of 2 uniform values in 0..STIMULUS_RANDOM_RANGE_US.
+#define STIMULUS_BASE_WAIT  70      // in ms, min. wait before the next press
+#define STIMULUS_RANDOM_RANGE_US  20000l  // in us
+
+// EEPROM layout.
+#define EEPROM_ADDR_CALIBRATION  0    // Cached calibrations (see Measure.cpp), 2x 24 bytes
+#define EEPROM_ADDR_ACTUATOR  48      // Actuator type and self-test results (see Actuator.cpp)
 
-// The checked accuracy in ms:
-#define CHECK_ACCURACY  1
+// Time after which a measurement is aborted if no signal is found (in ms).
+#define MEASURE_TIMEOUT  4000
+
+// Error if the measurement loop could not keep up with the sampling,
+// i.e. samples have been lost (see Sampler.cpp).
 #define CHECK_ACCURACY_ERROR_STR "Err:Accuracy>1ms"
 
 // Time to show the title of each test.
 #define TITLE_TIME  1500    // in ms
 
+// Time to show each page of the results.
+#define RESULT_PAGE_TIME  2000    // in ms
+
 #endif
@@ -0,0 +1,176 @@
+#include "Comparator.h"
+#include "Common.h"
+#include "Timebase.h"
+
+
+// The positive input of the analog comparator (AIN0).
+#define IN_PIN_COMPARATOR_REF  6
+
+// Time to wait for the RC low pass before each capture (in ms).
+// 5 time constants of 10k/1uF.
+#define COMPARATOR_REF_SETTLE_TIME  50
+
+
+// The input and direction of the running capture.
+static int comparatorInput;
+static bool comparatorPositive;
+// true if the input was already past the threshold when started.
+static bool alreadyCrossed;
+// true if the input crossed while the keypad was read.
+static bool captureLost;
+// Set by the capture interrupt.
+static volatile bool captured;
+static volatile uint32_t captureTime;
+
+
+// Called at the first crossing. Further captures are disabled so that
+// ICR1 is not overwritten by a bouncing signal.
+ISR(TIMER1_CAPT_vect) {
+	captureTime = extendTimebase(ICR1);
+	captured = true;
+	TIMSK1 &= ~(1 << ICIE1);
+}
+
+
+// Returns true if the input is past the threshold of the running capture.
+static bool isInputCrossed() {
+	// ACO is 1 if the reference is bigger than the input
+	bool aco = ACSR & (1 << ACO);
+	return (comparatorPositive) ? !aco : aco;
+}
+
+
+// Initializes the PWM for the reference voltage.
+// Timer 2, fast PWM, no prescaler -> 62.5kHz at OUT_PIN_COMPARATOR_REF (OC2B).
+void setupComparator() {
+	pinMode(OUT_PIN_COMPARATOR_REF, OUTPUT);
+	TCCR2A = (1 << COM2B1) | (1 << WGM21) | (1 << WGM20);
+	TCCR2B = (1 << CS20);
+	OCR2B = 0;
+}
+
+
+// Starts the capture of the threshold crossing.
+// The timebase needs to be started already. It should be reset afterwards.
+// @param inputPin The analog input. Photo sensor or SVGA.
+// @param threshold The ADC value to compare the input to. Converted into the PWM duty cycle.
+// @param positiveThreshold If true the rising crossing is captured, if false the falling.
+// @return false if the measured reference is out of range. Then the capture is not started.
+bool startComparator(int inputPin, int threshold, bool positiveThreshold) {
+	// Set reference. D6 is released by the LCD first (INPUT also switches
+	// off the pull-up), then the low pass settles.
+	OCR2B = constrain(((threshold + 2) >> 2) - 1, 0, 255);
+	pinMode(IN_PIN_COMPARATOR_REF, INPUT);
+	delay(COMPARATOR_REF_SETTLE_TIME);
+
+	// Check the reference
+	int reference = analogRead(IN_PIN_COMPARATOR_REF_SENSE);
+	if (abs(reference - threshold) > COMPARATOR_REF_TOLERANCE) {
+		pinMode(IN_PIN_COMPARATOR_REF, OUTPUT);
+		return false;
+	}
+
+	comparatorInput = inputPin;
+	comparatorPositive = positiveThreshold;
+	captureLost = false;
+
+	// Switch off the ADC and use its multiplexer for the negative input
+	ADCSRA &= ~(1 << ADEN);
+	ADMUX = (ADMUX & 0xF0) | inputPin;
+	ADCSRB |= (1 << ACME);
+
+	// The comparator output triggers the input capture of timer 1.
+	// ACO is 1 if the reference is bigger than the input, i.e. a rising
+	// input results in a falling edge.
+	ACSR = (1 << ACI) | (1 << ACIC);
+	if (positiveThreshold)
+		TCCR1B &= ~(1 << ICES1);
+	else
+		TCCR1B |= (1 << ICES1);
+	TCCR1B |= (1 << ICNC1);  // Noise canceler
+
+	// Changing ACIC or ICES1 may set the flag
+	delayMicroseconds(2);
+	captured = false;
+	TIFR1 = 1 << ICF1;  // Clear pending bits
+	TIMSK1 |= (1 << ICIE1);
+
+	// Check if the input is already past the threshold
+	alreadyCrossed = isInputCrossed();
+	return true;
+}
+
+
+// Reads the keypad (A0) while the crossing is captured.
+// The ADC is switched on for a single conversion. Meanwhile its
+// multiplexer is not connected to the comparator and the capture is
+// disabled. If the input crossed meanwhile the time is not known and
+// isComparatorCaptureLost() returns true. The conversion takes about
+// 100us, so this should be called only every few ms.
+// @return The analog value of the keypad, 1023 if the crossing has been captured already.
+int readKeypadDuringCapture() {
+	uint8_t sreg = SREG;
+	noInterrupts();
+	TIMSK1 &= ~(1 << ICIE1);
+	bool done = captured;
+	SREG = sreg;
+	if (done)
+		return 1023;
+
+	// Read keypad
+	ADCSRB &= ~(1 << ACME);
+	ADCSRA |= (1 << ADEN);
+	int value = analogRead(0);
+	ADCSRA &= ~(1 << ADEN);
+	ADMUX = (ADMUX & 0xF0) | comparatorInput;
+	ADCSRB |= (1 << ACME);
+
+	// Continue the capture
+	delayMicroseconds(2);
+	TIFR1 = 1 << ICF1;  // Clear pending bit
+	if (isInputCrossed())
+		captureLost = true;
+	else
+		TIMSK1 |= (1 << ICIE1);
+	return value;
+}
+
+
+// Stops the capture. Afterwards the ADC can be used again.
+void stopComparator() {
+	TIMSK1 &= ~(1 << ICIE1);
+	ACSR = 0;
+	ADCSRB &= ~(1 << ACME);
+	ADCSRA |= (1 << ADEN);
+	TCCR1B &= ~((1 << ICNC1) | (1 << ICES1));
+	pinMode(IN_PIN_COMPARATOR_REF, OUTPUT);
+}
+
+
+// Returns true if the crossing has been captured, if the input was
+// already past the threshold when started (see isComparatorAlreadyCrossed())
+// or if the capture was lost (see isComparatorCaptureLost()).
+bool isComparatorCaptured() {
+	return alreadyCrossed || captureLost || captured;
+}
+
+
+// Returns true if the input crossed while the keypad was read,
+// i.e. the time of the crossing is not known.
+bool isComparatorCaptureLost() {
+	return captureLost;
+}
+
+
+// Returns true if the input was already past the threshold when started.
+// Then there is no capture time: e.g. the phase or the threshold is wrong.
+bool isComparatorAlreadyCrossed() {
+	return alreadyCrossed;
+}
+
+
+// Returns the time (in ticks) latched at the crossing.
+// Not valid if the input was already past the threshold when started.
+uint32_t getComparatorCaptureTime() {
+	return captureTime;
+}
@@ -0,0 +1,39 @@
+#ifndef __Comparator_H__
+#define __Comparator_H__
+
+#include <Arduino.h>
+
+
+// The threshold crossing can be detected by the analog comparator instead of the ADC.
+// The comparator output triggers the input capture of timer 1, i.e. the time
+// of the crossing is latched by hardware. The first capture is extended to
+// the 32 bit timebase in the capture interrupt.
+// Positive input (AIN0, D6): Reference voltage. Generated by PWM at
+//   OUT_PIN_COMPARATOR_REF and a RC low pass (e.g. 10k/1uF). AIN0 can't be
+//   moved but D6 is also the data line DB6 of the LCD, so connect the low
+//   pass through a 100k resistor. The LCD writes load the low pass, so D6 is
+//   switched to input (without pull-up) before each capture and the low pass
+//   is given time to settle. The reference is then measured at
+//   IN_PIN_COMPARATOR_REF_SENSE (connected directly to the low pass) and the
+//   capture is refused if it is off by more than COMPARATOR_REF_TOLERANCE.
+// Negative input: The photo sensor or SVGA input via the ADC multiplexer.
+// While the comparator is used the ADC is off. The keypad is read in
+// between with readKeypadDuringCapture() every COMPARATOR_KEYPAD_INTERVAL.
+
+// Interval to read the keypad while the crossing is captured (in ms).
+#define COMPARATOR_KEYPAD_INTERVAL  50
+
+// Max. deviation of the measured reference from the threshold (in ADC steps).
+#define COMPARATOR_REF_TOLERANCE  8
+
+
+void setupComparator();
+bool startComparator(int inputPin, int threshold, bool positiveThreshold);
+void stopComparator();
+bool isComparatorCaptured();
+bool isComparatorAlreadyCrossed();
+bool isComparatorCaptureLost();
+int readKeypadDuringCapture();
+uint32_t getComparatorCaptureTime();
+
+#endif
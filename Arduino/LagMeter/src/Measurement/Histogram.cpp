@@ -0,0 +1,101 @@
+#include "Histogram.h"
+
+
+// Constructor.
+// @param binWidth The width of each bin, e.g. 500 (us).
+Histogram::Histogram(long binWidth) : binWidth(binWidth) {
+	clear();
+}
+
+
+// Removes all values.
+void Histogram::clear() {
+	offset = 0;
+	minValue = 0;
+	maxValue = 0;
+	count = 0;
+	memset(bins, 0, sizeof(bins));
+}
+
+
+// Adds a value.
+// The first value defines the range.
+void Histogram::add(long value) {
+	if (count == 0) {
+		// Center range around first value
+		offset = value - (HISTOGRAM_BINS / 2) * binWidth;
+		minValue = value;
+		maxValue = value;
+	}
+	else if (count == 0xFFFF) {
+		// Full
+		return;
+	}
+
+	// Min/max
+	if (value < minValue)
+		minValue = value;
+	if (value > maxValue)
+		maxValue = value;
+
+	// Widen the range until the value fits
+	while (value < offset)
+		widen(false);
+	while (value >= offset + HISTOGRAM_BINS * binWidth)
+		widen(true);
+
+	// Increase bin
+	uint8_t index = (value - offset) / binWidth;
+	bins[index]++;
+	count++;
+}
+
+
+// Doubles the bin width by merging 2 neighbor bins.
+// Only done when a value is outside the range, i.e. seldom.
+// @param up true to extend the range upwards, false to extend it downwards.
+void Histogram::widen(bool up) {
+	const uint8_t half = HISTOGRAM_BINS / 2;
+	if (up) {
+		// Merge into the lower half
+		for (uint8_t i = 0; i < half; i++)
+			bins[i] = bins[2 * i] + bins[2 * i + 1];
+		memset(&bins[half], 0, half * sizeof(bins[0]));
+	}
+	else {
+		// Merge into the upper half
+		for (uint8_t i = HISTOGRAM_BINS - 1; i >= half; i--)
+			bins[i] = bins[2 * (i - half)] + bins[2 * (i - half) + 1];
+		memset(bins, 0, half * sizeof(bins[0]));
+		offset -= HISTOGRAM_BINS * binWidth;
+	}
+	binWidth *= 2;
+}
+
+
+// Returns the value below which 'percent' of the values are.
+// The values inside a bin are assumed to be evenly distributed.
+// @param percent E.g. 50 for the median.
+// @return The value. 0 if the histogram is empty.
+long Histogram::getPercentile(uint8_t percent) const {
+	if (count == 0)
+		return 0;
+
+	// The rank of the value (starting at 1)
+	uint16_t rank = ((uint32_t)count * percent + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	// Search bin
+	uint16_t sum = 0;
+	for (uint8_t i = 0; i < HISTOGRAM_BINS; i++) {
+		uint16_t binCount = bins[i];
+		if (sum + binCount >= rank) {
+			// Interpolate inside the bin
+			long value = offset + i * binWidth + ((2l * (rank - sum) - 1) * binWidth) / (2l * binCount);
+			return constrain(value, minValue, maxValue);
+		}
+		sum += binCount;
+	}
+	return maxValue;
+}
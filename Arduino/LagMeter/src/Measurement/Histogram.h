@@ -0,0 +1,45 @@
+#ifndef __Histogram_H__
+#define __Histogram_H__
+
+#include <Arduino.h>
+
+
+// Number of bins of a histogram.
+#define HISTOGRAM_BINS  64
+
+
+// A histogram with fixed memory to get the percentiles of a run
+// without storing all values.
+// The range (HISTOGRAM_BINS*binWidth) is centered around the first value.
+// If a value is outside the range the bin width is doubled.
+class Histogram {
+public:
+	Histogram(long binWidth);
+
+	// Removes all values.
+	void clear();
+
+	// Adds a value. O(1) (apart from the seldom widening).
+	void add(long value);
+
+	// Returns the value below which 'percent' of the values are.
+	// Interpolated inside the bin and limited to the min/max value.
+	long getPercentile(uint8_t percent) const;
+
+	// Returns the number of values.
+	uint16_t getCount() const {
+		return count;
+	}
+
+protected:
+	void widen(bool up);
+
+	long binWidth;	// The width of each bin
+	long offset;	// The lower edge of the first bin
+	long minValue;
+	long maxValue;
+	uint16_t count;
+	uint16_t bins[HISTOGRAM_BINS];
+};
+
+#endif
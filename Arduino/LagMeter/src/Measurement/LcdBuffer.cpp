@@ -0,0 +1,60 @@
+#include "LcdBuffer.h"
+
+
+LcdBuffer::LcdBuffer(LiquidCrystal& display) : display(display) {
+	clear();
+	memset(shown, ' ', sizeof(shown));
+	displayPos = 0;
+}
+
+
+void LcdBuffer::begin(uint8_t cols, uint8_t rows) {
+	display.begin(cols, rows);
+	display.clear();
+	memset(shown, ' ', sizeof(shown));
+	displayPos = 0;
+}
+
+
+void LcdBuffer::clear() {
+	memset(buffer, ' ', sizeof(buffer));
+	col = 0;
+	row = 0;
+}
+
+
+void LcdBuffer::setCursor(uint8_t col, uint8_t row) {
+	this->col = col;
+	this->row = (row < LCD_ROWS) ? row : LCD_ROWS - 1;
+}
+
+
+size_t LcdBuffer::write(uint8_t c) {
+	if (col >= LCD_COLS)
+		return 1;	// Dropped (not visible)
+	buffer[row][col++] = c;
+	return 1;
+}
+
+
+bool LcdBuffer::update(uint8_t count) {
+	// Search the changed characters, starting at the cursor of the display
+	// so that consecutive characters don't need a setCursor().
+	for (uint8_t i = 0; i < LCD_ROWS * LCD_COLS; i++) {
+		uint8_t pos = (displayPos + i) % (LCD_ROWS * LCD_COLS);
+		uint8_t r = pos / LCD_COLS;
+		uint8_t c = pos % LCD_COLS;
+		if (buffer[r][c] == shown[r][c])
+			continue;
+		if (count == 0)
+			return false;
+		count--;
+		if (pos != displayPos)
+			display.setCursor(c, r);
+		display.write(buffer[r][c]);
+		shown[r][c] = buffer[r][c];
+		// The display moves the cursor to the right, not to the next row
+		displayPos = (c + 1 < LCD_COLS) ? pos + 1 : LCD_ROWS * LCD_COLS;
+	}
+	return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __LcdBuffer_H__
+#define __LcdBuffer_H__
+
+#include <LiquidCrystal.h>
+
+
+// Size of the display.
+#define LCD_COLS  16
+#define LCD_ROWS  2
+
+// Max. number of characters written to the display per update() call.
+// Each character takes about 0.2ms with the 4 bit interface.
+#define LCD_UPDATE_SLICE  4
+
+
+// Shadow buffer of the LCD.
+// print(), setCursor() and clear() only change the buffer, i.e. they
+// are fast and can be used anywhere in the measurement code.
+// update() writes the changed characters to the display, a few per call.
+// It is called by a task (see Scheduler.h), i.e. only in the waits
+// between the timed windows.
+class LcdBuffer : public Print {
+public:
+	LcdBuffer(LiquidCrystal& display);
+
+	// Initializes the display (cols x rows must not exceed LCD_COLS x LCD_ROWS).
+	void begin(uint8_t cols, uint8_t rows);
+
+	// Clears the buffer and sets the cursor to 0, 0.
+	void clear();
+
+	void setCursor(uint8_t col, uint8_t row);
+
+	// Writes a character into the buffer at the cursor.
+	// Characters beyond the end of the line are dropped.
+	virtual size_t write(uint8_t c);
+	using Print::write;
+
+	// Writes up to 'count' changed characters to the display.
+	// @return true if the display is up to date.
+	bool update(uint8_t count = LCD_UPDATE_SLICE);
+
+protected:
+	LiquidCrystal& display;
+	char buffer[LCD_ROWS][LCD_COLS];
+	char shown[LCD_ROWS][LCD_COLS];	// The content of the display
+	uint8_t col;
+	uint8_t row;
+	uint8_t displayPos;	// Position of the cursor of the display (row * LCD_COLS + col)
+};
+
+#endif
@@ -1,7 +1,18 @@
 #include "Utilities.h"
 #include "Common.h"
 #include "Measure.h"
+#include "Sampler.h"
+#include "Comparator.h"
+#include "Timebase.h"
+#include "Statistics.h"
+#include "ResultStream.h"
+#include "Stimulus.h"
+#include "RefreshRate.h"
+#include "Button.h"
+#include "Actuator.h"
+#include "Scheduler.h"
 #include <Arduino.h>
+#include <EEPROM.h>
 
 
 
@@ -20,12 +31,59 @@ const int KEY_MEASURE_MIN_DOWN10 = LCD_KEY_LEFT;
 // The minimum diff required between min/max ov the SVGA signal.
 #define SVGA_MIN_DIFF  20
 
+// Calibration: The min/max measurement of a state stops as soon as the
+// envelope has not grown for CALIB_STABLE_TIME (in ms), but lasts
+// at most CALIB_MEASURE_TIME.
+#define CALIB_STABLE_TIME  250
+#define CALIB_MEASURE_TIME  1500
+// Calibration: Wait time after pressing/releasing the button (in ms).
+#define CALIB_SETTLE_TIME  500
+// Calibration: Time to show the measured values (in ms).
+#define CALIB_SHOW_TIME  500
+// Calibration: Wait time after the input has crossed the cached threshold
+// before the cached calibration is verified (in ms).
+#define CALIB_VERIFY_SETTLE_TIME  100
+
+// Hysteresis of the thresholds: The press is detected 1/2^n of the gap
+// between the ranges above the middle, the release 1/2^n below.
+#define CALIB_HYSTERESIS_SHIFT  3
+// Level tracking: Weight of the previous edge value for the exponential
+// moving average, i.e. each cycle moves the edge 1/n towards the new value.
+#define CALIB_TRACK_WEIGHT  8
+// Level tracking: Min. gap between the ranges (edges are not moved closer).
+#define CALIB_TRACK_MIN_GAP  4
+// Level tracking: Samples of the pressed range are collected in blocks of
+// this time (in us). The first block and the last 2 blocks before the input
+// leaves the pressed range are not used, they may contain the transitions.
+#define CALIB_TRACK_BLOCK_TIME  10000
+
+// Max. number of cycles per run that are repeated because the input
+// was earlier than the 2nd trigger.
+#define MAX_EARLY_CYCLES  20
+
+// Minimum press time test: Number of presses per press time during
+// the search and bisection.
+#define MIN_PRESS_PROBE_TRIALS  10
+// Minimum press time test: The confirmation assures with a confidence of
+// MIN_PRESS_CONFIDENCE (in %) that less than MIN_PRESS_FAILURE_RATE (in %)
+// of the presses are missed. 95% and 1% require 299 presses.
+#define MIN_PRESS_CONFIDENCE  95
+#define MIN_PRESS_FAILURE_RATE  1
+// Minimum press time test: Max. press time (in ms).
+#define MIN_PRESS_MAX_TIME  500
+
+// Poll period test: Number of presses per press time.
+#define POLL_SWEEP_TRIALS  20
+// Poll period test: Min. number of press times in a row that are always
+// recognized before the sweep stops (at least a quarter of the ramp width).
+#define POLL_SWEEP_MIN_FULL  3
+
 
 // Initializes the pins.
 void setupMeasurement() {
 	// Setup GPIOs
-	pinMode(OUT_PIN_BUTTON, OUTPUT);
-	digitalWrite(OUT_PIN_BUTTON, LOW);
+	setupButton();
+	setupActuator();
 	pinMode(IN_PIN_PHOTO_SENSOR, INPUT);
 	pinMode(IN_PIN_SVGA, INPUT);
 
@@ -33,6 +91,14 @@ void setupMeasurement() {
 	pinMode(OUT_PIN_BUTTON_COMPARE_TIME, OUTPUT);
 	digitalWrite(OUT_PIN_BUTTON_COMPARE_TIME, LOW);
 #endif
+
+#ifdef COMPARATOR_ENABLED
+	setupComparator();
+#endif
+
+	setupResultStream();
+	if (!addTask(pumpResultStream, 0))
+		Error(F("Error:"), F("Too many tasks"));
 }
 
 
@@ -82,23 +148,36 @@ void testPhotoSensor() {
 
 
 // Returns the min/max photo sensor values for a given time frame.
-struct MinMax getMaxMinAnalogIn(int inputPin, int measTime) {
+// @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
+// @param measTime The max. time to measure (in ms).
+// @param stableTime (Optional) If > 0 the measurement stops as soon as the
+// min/max values have not changed for this time (in ms).
+struct MinMax getMaxMinAnalogIn(int inputPin, int measTime, int stableTime) {
 	struct MinMax value;
 	value.min = value.max = analogRead(inputPin);
 	int time;
 	int startTime = millis();
+	int changeTime = startTime;
 	do {
 		// Read photo sensor
 		int currValue = analogRead(inputPin);
-		if (currValue > value.max)
+		if (currValue > value.max) {
 			value.max = currValue;
-		else if (currValue < value.min)
+			changeTime = millis();
+		}
+		else if (currValue < value.min) {
 			value.min = currValue;
+			changeTime = millis();
+		}
 
 		// Get elapsed time
-		time = millis() - startTime;
+		int now = millis();
+		time = now - startTime;
 		if (isAbort())
 			break;
+		// Check if the envelope has converged
+		if (stableTime > 0 && now - changeTime >= stableTime)
+			break;
 	} while (time < measTime);
 
 	// Add small safety margin
@@ -108,31 +187,368 @@ struct MinMax getMaxMinAnalogIn(int inputPin, int measTime) {
 }
 
 
-// Waits until the input pin value stays in range for a given time.
+// A calibration stored in EEPROM together with the measured ranges.
+struct CalibrationCache {
+	uint16_t magic;	// CALIB_CACHE_MAGIC if valid
+	struct MinMax rangeOn;	// Input range while the button is pressed
+	struct MinMax rangeOff;	// Input range while the button is released
+	struct Calibration calib;
+};
+
+// Marks a valid cache entry. Change it if CalibrationCache changes.
+#define CALIB_CACHE_MAGIC  0xCA02
+
+// Index of the cache entry of each input.
+enum {
+	CALIB_CACHE_PHOTO = 0,
+	CALIB_CACHE_AD2 = 1,
+};
+
+
+// Stores the calibration of an input in EEPROM.
+// @param index CALIB_CACHE_PHOTO or CALIB_CACHE_AD2.
+static void storeCalibration(uint8_t index, const struct MinMax& rangeOn, const struct MinMax& rangeOff, const struct Calibration& calib) {
+	struct CalibrationCache cache;
+	cache.magic = CALIB_CACHE_MAGIC;
+	cache.rangeOn = rangeOn;
+	cache.rangeOff = rangeOff;
+	cache.calib = calib;
+	EEPROM.put(EEPROM_ADDR_CALIBRATION + index * sizeof(cache), cache);
+}
+
+
+// Sets the button and measures the input range once the input has
+// settled at the new level:
+// Rising input: As soon as the input is above the threshold (+ CALIB_VERIFY_SETTLE_TIME).
+// Falling input: As soon as the input stayed below the threshold for CALIB_VERIFY_SETTLE_TIME.
+// This works also for the SVGA signal which is below the threshold
+// during the blanking. At most CALIB_SETTLE_TIME is waited.
+static struct MinMax getVerifyRange(int inputPin, const struct Calibration& calib, bool press) {
+	digitalWrite(OUT_PIN_BUTTON, press ? HIGH : LOW);
+	bool rising = (calib.positiveThreshold == press);
+	unsigned long startTime = millis();
+	unsigned long highTime = startTime;	// Last time the input was above the threshold
+	while (true) {
+		int value = analogRead(inputPin);
+		unsigned long now = millis();
+		if (value > calib.threshold) {
+			highTime = now;
+			if (rising)
+				break;	// New level reached
+		}
+		else if (!rising && now - highTime >= CALIB_VERIFY_SETTLE_TIME)
+			break;	// Stays below the threshold
+		if (now - startTime >= CALIB_SETTLE_TIME || isAbort())
+			break;
+	}
+	if (rising)
+		waitMs(CALIB_VERIFY_SETTLE_TIME);
+	return getMaxMinAnalogIn(inputPin, CALIB_MEASURE_TIME, CALIB_STABLE_TIME);
+}
+
+
+// Checks that the range lies within the cached range (plus a margin).
+static bool isInRange(const struct MinMax& range, const struct MinMax& cached, int margin) {
+	return (range.min >= cached.min - margin && range.max <= cached.max + margin);
+}
+
+
+// Checks that the ranges for pressed and released button lie on
+// different sides of the threshold in the direction of the calibration.
+// This implies that they do not overlap.
+// For peak levels (SVGA) only the maxima are used as the blanking
+// pulls the minima of both ranges down.
+static bool isSeparated(const struct MinMax& rangeOn, const struct MinMax& rangeOff, const struct Calibration& calib) {
+	int onMin = calib.peakLevels ? rangeOn.max : rangeOn.min;
+	int offMin = calib.peakLevels ? rangeOff.max : rangeOff.min;
+	if (calib.positiveThreshold)
+		return (rangeOff.max < calib.threshold && onMin > calib.threshold);
+	return (rangeOn.max < calib.threshold && offMin > calib.threshold);
+}
+
+
+// Checks if the calibration stored in EEPROM still matches the input,
+// i.e. if the input ranges for pressed and released button are
+// the same as at the time of the calibration and if they are still
+// separated by the cached threshold.
+// This takes less than a second compared to the full calibration.
+// @param index CALIB_CACHE_PHOTO or CALIB_CACHE_AD2.
+// @param inputPin The input to check.
+// @param calib The cached calibration is returned here.
+// @return true if the cached calibration can be used.
+static bool verifyCachedCalibration(uint8_t index, int inputPin, struct Calibration& calib) {
+	struct CalibrationCache cache;
+	EEPROM.get(EEPROM_ADDR_CALIBRATION + index * sizeof(cache), cache);
+	if (cache.magic != CALIB_CACHE_MAGIC)
+		return false;
+
+	// Margin: a quarter of the distance between the levels
+	int margin = abs(cache.calib.levelOn - cache.calib.levelOff) / 4;
+	struct MinMax rangeOn = getVerifyRange(inputPin, cache.calib, true);
+	if (isAbort()) return false;
+	struct MinMax rangeOff = getVerifyRange(inputPin, cache.calib, false);
+	if (isAbort()) return false;
+	if (!isInRange(rangeOn, cache.rangeOn, margin) || !isInRange(rangeOff, cache.rangeOff, margin))
+		return false;
+	if (!isSeparated(rangeOn, rangeOff, cache.calib))
+		return false;
+
+	calib = cache.calib;
+	lcd.setCursor(0, 1);
+	lcd.print(F("Cached"));
+	return true;
+}
+
+
+// Calibrates the photo sensor.
+// Checks first if the last calibration (EEPROM) is still valid.
+// Otherwise:
+// Simulate joystick button press -> measure min/max photo sensor value.
+// Simulate joystick button unpress -> measure min/max photo sensor value.
+// The ranges are printed to the LCD.
+// @param calib The threshold and the levels are returned here.
+// @return false on abort or if the ranges overlap (an error is shown).
+bool calibratePhotoSensor(struct Calibration& calib) {
+	lcd.clear();
+	lcd.print(F("Calib. Photo S."));
+	if (verifyCachedCalibration(CALIB_CACHE_PHOTO, IN_PIN_PHOTO_SENSOR, calib))
+		return true;
+	if (isAbort()) return false;
+	// Simulate joystick button press
+	digitalWrite(OUT_PIN_BUTTON, HIGH);
+	waitMs(CALIB_SETTLE_TIME); if (isAbort()) return false;
+	// Get max/min light value
+	struct MinMax buttonOnLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, CALIB_MEASURE_TIME, CALIB_STABLE_TIME);
+	if (isAbort()) return false;
+	// Print
+	lcd.setCursor(0, 1);
+	lcd.print(buttonOnLight.min);
+	lcd.print(F("-"));
+	lcd.print(buttonOnLight.max);
+	// Simulate joystick button unpress
+	digitalWrite(OUT_PIN_BUTTON, LOW);
+	waitMs(CALIB_SETTLE_TIME); if (isAbort()) return false;
+	// Get max/min light value
+	struct MinMax buttonOffLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, CALIB_MEASURE_TIME, CALIB_STABLE_TIME);
+	if (isAbort()) return false;
+	// Print
+	lcd.setCursor(0, 1);
+	lcd.print(buttonOffLight.min);
+	lcd.print(F("-"));
+	lcd.print(buttonOffLight.max);
+	lcd.print(F("         "));
+	waitMs(CALIB_SHOW_TIME); if (isAbort()) return false;
+
+	// Check values. They should not overlap.
+	bool overlap = (buttonOnLight.max >= buttonOffLight.min && buttonOnLight.min <= buttonOffLight.max);
+	if (overlap) {
+		// Error
+		Error(F("Calibr. Error:"), F("Ranges overlap"));
+		return false;
+	}
+
+	// Calculate the thresholds around the middle between the ranges
+	calib.positiveThreshold = (buttonOnLight.max > buttonOffLight.max);
+	calib.levelOn = (buttonOnLight.min + buttonOnLight.max) / 2;
+	calib.levelOff = (buttonOffLight.min + buttonOffLight.max) / 2;
+	calib.edgeOn = (calib.positiveThreshold) ? buttonOnLight.min : buttonOnLight.max;
+	calib.edgeOff = (calib.positiveThreshold) ? buttonOffLight.max : buttonOffLight.min;
+	calib.peakLevels = false;
+	setThresholds(calib);
+	storeCalibration(CALIB_CACHE_PHOTO, buttonOnLight, buttonOffLight, calib);
+	return true;
+}
+
+
+// Calibrates the AD2 (SVGA) input.
+// Checks first if the last calibration (EEPROM) is still valid.
+// Otherwise:
+// Simulate joystick button press -> measure svga brightness, i.e. max signal.
+// Simulate joystick button unpress -> measure svga darkness, i.e. max signal.
+// The values are printed to the LCD.
+// @param calib The threshold and the levels are returned here.
+// @param showError If true an error is shown if the signal is too weak.
+// @return false on abort or if the signal is too weak.
+bool calibrateAD2(struct Calibration& calib, bool showError) {
+	lcd.clear();
+	lcd.print(F("Calibrate AD2"));
+	if (verifyCachedCalibration(CALIB_CACHE_AD2, IN_PIN_SVGA, calib))
+		return true;
+	if (isAbort()) return false;
+	// Simulate joystick button press
+	digitalWrite(OUT_PIN_BUTTON, HIGH);
+	waitMs(CALIB_SETTLE_TIME); if (isAbort()) return false;
+	// Get max svga value
+	struct MinMax buttonOnSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, CALIB_MEASURE_TIME, CALIB_STABLE_TIME);
+	if (isAbort()) return false;
+	// Print
+	lcd.setCursor(0, 1);
+	lcd.print(buttonOnSVGA.max);
+	// Simulate joystick button unpress
+	digitalWrite(OUT_PIN_BUTTON, LOW);
+	waitMs(CALIB_SETTLE_TIME); if (isAbort()) return false;
+	// Get max/min light value
+	struct MinMax buttonOffSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, CALIB_MEASURE_TIME, CALIB_STABLE_TIME);
+	if (isAbort()) return false;
+	// Print
+	lcd.setCursor(0, 1);
+	lcd.print(buttonOffSVGA.max);
+	lcd.print(F("         "));
+	waitMs(CALIB_SHOW_TIME); if (isAbort()) return false;
+
+	// Print diff
+	lcd.setCursor(0, 1);
+	lcd.print(F("Diff="));
+	lcd.print(buttonOnSVGA.max - buttonOffSVGA.max);
+	lcd.print(F("         "));
+	waitMs(CALIB_SHOW_TIME); if (isAbort()) return false;
+
+	// Calculate the thresholds around the middle
+	calib.positiveThreshold = (buttonOnSVGA.max > buttonOffSVGA.max);
+	calib.levelOn = buttonOnSVGA.max;
+	calib.levelOff = buttonOffSVGA.max;
+	calib.edgeOn = buttonOnSVGA.max;
+	calib.edgeOff = buttonOffSVGA.max;
+	calib.peakLevels = true;
+	setThresholds(calib);
+
+	// Check values. They should differ clearly. (Should be around 100.)
+	if (buttonOnSVGA.max - buttonOffSVGA.max < SVGA_MIN_DIFF) {
+		// Error
+		if (showError)
+			Error(F("Calibr. Error:"), F("Signal too weak"));
+		return false;
+	}
+	storeCalibration(CALIB_CACHE_AD2, buttonOnSVGA, buttonOffSVGA, calib);
+	return true;
+}
+
+
+// Sets the thresholds from the edges of the ranges:
+// The press is detected above the middle, the release below (hysteresis).
+// The distance to the middle is 1/2^CALIB_HYSTERESIS_SHIFT of the gap.
+void setThresholds(struct Calibration& calib) {
+	int middle = (calib.edgeOn + calib.edgeOff) / 2;
+	int hysteresis = (calib.edgeOn - calib.edgeOff) / (1 << CALIB_HYSTERESIS_SHIFT);
+	calib.threshold = middle + hysteresis;
+	calib.thresholdRelease = middle - hysteresis;
+}
+
+
+// Extends the range by a value.
+static inline void extendRange(struct MinMax& range, int value) {
+	if (value < range.min)
+		range.min = value;
+	if (value > range.max)
+		range.max = value;
+}
+
+
+// Moves an edge 1/CALIB_TRACK_WEIGHT towards a new value (rounded).
+static inline int trackEdge(int edge, int value) {
+	int diff = value - edge;
+	diff += (diff > 0) ? CALIB_TRACK_WEIGHT / 2 : -CALIB_TRACK_WEIGHT / 2;
+	return edge + diff / CALIB_TRACK_WEIGHT;
+}
+
+
+// Moves the edges of the calibration towards the ranges measured in one
+// cycle and sets the thresholds again.
+// @param calib The calibration to update.
+// @param onRange The range while the button was pressed. Empty if min > max.
+// @param offRange The range while the button was released. Empty if min > max.
+static void trackLevels(struct Calibration& calib, const struct MinMax& onRange, const struct MinMax& offRange) {
+	bool positive = calib.positiveThreshold;
+	int edgeOn = calib.edgeOn;
+	int edgeOff = calib.edgeOff;
+	if (onRange.min <= onRange.max)
+		edgeOn = trackEdge(edgeOn, (!positive) ? onRange.max : onRange.min);
+	if (offRange.min <= offRange.max)
+		edgeOff = trackEdge(edgeOff, (calib.peakLevels || positive) ? offRange.max : offRange.min);
+
+	// Don't let the ranges collapse
+	int gap = (positive) ? edgeOn - edgeOff : edgeOff - edgeOn;
+	if (gap < CALIB_TRACK_MIN_GAP)
+		return;
+	calib.edgeOn = edgeOn;
+	calib.edgeOff = edgeOff;
+	setThresholds(calib);
+}
+
+
+// Releases the button and waits until the input pin value stays in range
+// for a given time.
+// The time is measured from the last value out of range, i.e. from the
+// reaction of the system to the button release. Because this reaction is
+// locked to the frame the wait time determines the phase of the next press.
 // @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
 // @param threshold The value to compare the inputPin value to.
 // @param positiveThreshold If true check that inputPin value is bigger, if false check that inputPin value is smaller.
-// @param waitTime The time to wait for.
+// @param waitTime The time to wait for (in us).
+// @param track (Optional) If given the edges of the calibration are tracked.
+// The pressed range is taken from the values before the reaction
+// to the release, the released range from the final waitTime.
+// For peak levels (SVGA) only the released edge is tracked: the blanking
+// ends the pressed range already with its first line, i.e. before a
+// block is complete.
 // @return The pressed key or LCD_KEY_NONE.
-int waitMsInput(int inputPin, int threshold, bool positiveThreshold, int waitTime) {
+static int waitInputTracked(int inputPin, int threshold, bool positiveThreshold, unsigned long waitTime, struct Calibration* track) {
 	// Simulate joystick button
 	digitalWrite(OUT_PIN_BUTTON, LOW);
 	// Wait
-	int time;
-	int startTime = millis();
-	int watchdogTime = startTime;
+	unsigned long time;
+	unsigned long startTime = micros();
+	unsigned long watchdogTime = startTime;
+	// Level tracking
+	struct MinMax onRange = { 1023, 0 };
+	struct MinMax offRange = { 1023, 0 };
+	struct MinMax blocks[2] = { { 1023, 0 }, { 1023, 0 } };	// Last 2 blocks of the pressed range
+	unsigned long blockTime = startTime;
+	uint8_t blockCount = 0;	// Number of completed blocks (max. 2)
+	bool pressedRange = (track != nullptr && !track->peakLevels);
 	do {
+		// Transmit the results of the previous measurement
+		pumpResultStream();
 		// Get input value
 		int value = analogRead(inputPin);
+		unsigned long currTime = micros();
 		// Check for threshold (not fulfilled)
 		if (!((positiveThreshold && value > threshold) // Check if value is bigger
 			|| (!positiveThreshold && value < threshold))) // Check if value is smaller
 		{
 			// Out of range, restart timer
-			startTime = millis();
+			startTime = currTime;
+			offRange.min = 1023;
+			offRange.max = 0;
+			// Collect the pressed range until it is left the first time
+			if (pressedRange) {
+				bool pressed = (track->positiveThreshold) ? (value > track->threshold) : (value < track->threshold);
+				if (!pressed) {
+					pressedRange = false;
+				}
+				else if (currTime - blockTime < CALIB_TRACK_BLOCK_TIME) {
+					extendRange(blocks[1], value);
+				}
+				else {
+					// Next block. The first block is not used.
+					if (blockCount >= 2) {
+						extendRange(onRange, blocks[0].min);
+						extendRange(onRange, blocks[0].max);
+					}
+					else {
+						blockCount++;
+					}
+					blocks[0] = blocks[1];
+					blocks[1].min = blocks[1].max = value;
+					blockTime = currTime;
+				}
+			}
+		}
+		else {
+			pressedRange = false;
+			extendRange(offRange, value);
 		}
 		// Get time
-		int currTime = millis();
 		time = currTime - startTime;
 
 		// Check for key press
@@ -143,184 +559,215 @@ int waitMsInput(int inputPin, int threshold, bool positiveThreshold, int waitTim
 		}
 
 		// Check if waited too long (4 secs)
-		if (currTime - watchdogTime > 4000) {
+		if (currTime - watchdogTime > MEASURE_TIMEOUT * 1000l) {
 			// Error
 			Error(nullptr, F("Err:Signal wrong"));
-			break;
+			return LCD_KEY_NONE;
 		}
 	} while (time < waitTime);
 
+	if (track)
+		trackLevels(*track, onRange, offRange);
 	return LCD_KEY_NONE;
 }
 
 
+// Releases the button and waits until the input pin value stays in range
+// for a given time. See waitInputTracked().
+int waitInput(int inputPin, int threshold, bool positiveThreshold, unsigned long waitTime) {
+	return waitInputTracked(inputPin, threshold, positiveThreshold, waitTime, nullptr);
+}
+
+
+// Releases the button and waits until the input pin value stays in the
+// released range (calib.thresholdRelease) for a given time.
+// The edges of the calibration are tracked, i.e. the thresholds follow
+// slow drifts of the levels (e.g. ambient light, monitor warm-up).
+// For SVGA only the released edge is tracked (see waitInputTracked()).
+// @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
+// @param calib The calibration of the input. Updated.
+// @param waitTime The time to wait for (in us).
+// @return The pressed key or LCD_KEY_NONE.
+int waitInput(int inputPin, struct Calibration& calib, unsigned long waitTime) {
+	return waitInputTracked(inputPin, calib.thresholdRelease, !calib.positiveThreshold, waitTime, &calib);
+}
+
+
 // Waits until the photo sensor (or SVGA value) value gets into range.
+// The input is sampled by the free running ADC (see Sampler.cpp). Each sample
+// carries the time latched at conversion complete, so the result
+// does not depend on the speed of the loop.
 // @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
 // @param threshold The value to compare the inputPin value to.
 // @param positiveThreshold If true check that inputPin value is bigger, if false check that inputPin value is smaller.
 // @param inputPinWait (Optional) If given: wait for inputPinWait value to get in 'rangeWait' before starting the measurement.
 // @param thresholdWait (Optional) The value to compare the inputPinWait value to. (Always positive threshold)
-int measureLag(int inputPin, int threshold, bool positiveThreshold, int inputPinWait = -1, int thresholdWait = 0) {
-	int key = 1023;
-	unsigned int tcount1 = 0;
+// @param ticks Returns the lag in timebase ticks. If inputPinWait is given the lag since inputPinWait got in range.
+// @param waitTicks (Optional) Returns the time from button press until inputPinWait got in range (in timebase ticks).
+// @return false on error or abort. Errors are shown and abortAll is set,
+// except if inputPin got in range before inputPinWait (no error shown).
+bool measureLag(int inputPin, int threshold, bool positiveThreshold, uint32_t& ticks, int inputPinWait = -1, int thresholdWait = 0, uint32_t* waitTicks = nullptr) {
+	struct Sample sample;
+	struct Sample prevSample = { 0, 0, SAMPLE_CHANNEL_NONE };
+	struct Sample prevSampleWait = { 0, 0, SAMPLE_CHANNEL_NONE };
+	uint32_t time = 0;
+	uint32_t waitTime = 0;
+	bool waitFound = (inputPinWait < 0);
 	bool accuracyOvrflw = false;
 	bool counterOvrflw = false;
 	bool keyPressed = false;
+	bool alreadyCrossed = false;
+	const uint32_t timeout = usToTicks(MEASURE_TIMEOUT * 1000l);
+
+	// Setup timer 1 to measure the time (resolution 0.5us at F_CPU=16MHz).
+	startTimebase();
+
+#ifdef COMPARATOR_ENABLED
+	// Use the analog comparator if there is no 2nd trigger.
+	// The 2nd trigger is always sampled with the ADC.
+	bool useComparator = (inputPinWait < 0);
+	if (useComparator && !startComparator(inputPin, threshold, positiveThreshold)) {
+		stopTimebase();
+		Error(F("Comparator:"), F("Check reference"));
+		return false;
+	}
+#endif
 
-	// Turnoff interrupts.
-	noInterrupts();
-
-	const int adjust = 16000000 / F_CPU;  // 1 for 16MHz, 2 for 8MHz.
-	//const int tcnt2Value = 256-(0.5/0.004/adjust); //  131;  // (256-131)*4us = 0.5ms, would work up to (256-220)*4us = 0.144ms
-	const int tcnt2Value = 256 - (CHECK_ACCURACY / 0.064 / adjust); // 2ms
-
-	// Setup timer 1 (16 bit timer) to measure the time:
-	// Prescaler: 1024 -> resolution 64us (at F_CPU=16MHz).
-	// No timer compare register.
-	TCCR1A = 0; // No PWM
-	TCCR1B = (1 << CS10) | (1 << CS12);  // Prescaler = 1024
-	TIMSK1 = 1 << TOIE1;  // For polling only
-
-	// Setup timer 2 (8 bit timer) to check measurement accuracy:
-	// Prescaler: 1024 -> resolution 64us (at F_CPU=16MHz).
-	// No timer compare register.
-	TCCR2A = 0; // No PWM
-	TCCR2B = (1 << CS10) | (1 << CS12);  // Prescaler = 1024
-	TIMSK2 = 1 << TOIE2;  // For polling only
-
-	// Reset timer
-	TCNT2 = tcnt2Value;
-	TCNT1 = 0;
-	TIFR1 = 1 << TOV1;  // Clear pending bits
-	TIFR2 = 1 << TOV2;  // Clear pending bits
+	// Simulate joystick button and reset timer
+	resetTimebaseWithButton(true);
 
-	// Simulate joystick button
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
+#ifdef OUT_PIN_BUTTON_COMPARE_TIME
+	if (outpValue)
+		digitalWrite(OUT_PIN_BUTTON_COMPARE_TIME, HIGH);
+#endif
 
-	// Check if we wait for a 2nd trigger (required to measure the delay between SVGA out and monitor)
-	if (inputPinWait >= 0) {
-		// Wait on trigger
-		int counter = 1;
-		while (true) {
-			// Check range of wait-input-pin
-			int value = analogRead(inputPinWait);
-			// Check for thresholdWait
-			if (value > thresholdWait) {
-				// Restart measurement
-				TCNT2 = tcnt2Value;
-				TCNT1 = 0;
+#ifdef COMPARATOR_ENABLED
+	if (useComparator) {
+		// Wait until the crossing is captured.
+		// The keypad is read in between (see readKeypadDuringCapture()).
+		const uint32_t keypadInterval = usToTicks(COMPARATOR_KEYPAD_INTERVAL * 1000l);
+		uint32_t keypadTime = keypadInterval;
+		while (!isComparatorCaptured()) {
+			uint32_t now = getTimebase();
+			// Check for time out
+			if (now > timeout) {
+				counterOvrflw = true;
 				break;
 			}
-
-			/*
-			// Assure that measurement accuracy is good enough
-			TCNT2 = tcnt2Value;
-			if(TIFR2 & (1<<TOV2)) {
-			  // Error
-			  accuracyOvrflw = true;
-			  goto L_ERROR;
-			}
-			*/
-
-			// Do this not in every loop
-			counter--;
-			if (counter == 0) {
-				counter = 1000;
-				// Check if key pressed
-				key = analogRead(0);
-				// Return immediately if something is pressed
-				if (key < LCD_KEY_PRESS_THRESHOLD) {
+			// Check if key pressed
+			if (now >= keypadTime) {
+				if (readKeypadDuringCapture() < LCD_KEY_PRESS_THRESHOLD) {
 					keyPressed = true;
-					goto L_ERROR;
-				}
-
-				// Check for time out
-				if (TIFR1 & (1 << TOV1)) {
-					// Interrupt pending bit set -> Overflow happened.
-					// This means 4.19 seconds elapsed with no signal.
-					counterOvrflw = true;
-					goto L_ERROR;
+					break;
 				}
+				keypadTime = now + keypadInterval;
 			}
 		}
+		time = getComparatorCaptureTime();
+		alreadyCrossed = isComparatorAlreadyCrossed();
+		accuracyOvrflw = isComparatorCaptureLost();
+		stopComparator();
+		goto L_ERROR;
 	}
-
-#ifdef OUT_PIN_BUTTON_COMPARE_TIME
-	if (outpValue)
-		digitalWrite(OUT_PIN_BUTTON_COMPARE_TIME, HIGH);
 #endif
 
-	TIFR2 = 1 << TOV2;  // Clear pending bits
+	// If there is a 2nd trigger (required to measure the delay between SVGA out and monitor)
+	// both inputs are sampled interleaved. The crossing of the 2nd trigger is
+	// timestamped and the input pin is checked only afterwards.
+	// The crossing times are interpolated between the last sample before
+	// and the first sample after the crossing.
+	startSampling(inputPin, inputPinWait);
 	while (true) {
 		// Check range of input pin
-		int value = analogRead(inputPin);
-		// Check for threshold
-		if ((positiveThreshold && value > threshold) // Check if value is bigger
-			|| (!positiveThreshold && value < threshold)) // Check if value is smaller
-		{
-			tcount1 = TCNT1;
-			break;
+		if (getSample(sample)) {
+			if (!waitFound) {
+				// Check for thresholdWait
+				if (sample.channel == inputPinWait) {
+					if (sample.value > thresholdWait) {
+						waitTime = interpolateCrossing(prevSampleWait, sample, thresholdWait);
+						waitFound = true;
+					}
+					prevSampleWait = sample;
+				}
+			}
+			// Check for threshold
+			else if (sample.channel == inputPin
+				&& ((positiveThreshold && sample.value > threshold) // Check if value is bigger
+				|| (!positiveThreshold && sample.value < threshold))) // Check if value is smaller
+			{
+				time = interpolateCrossing(prevSample, sample, threshold);
+				break;
+			}
+			if (sample.channel == inputPin)
+				prevSample = sample;
+			// Check for time out.
+			// Note: The sample time is used so that interrupts are not
+			// disabled to read the timebase.
+			if (sample.time > timeout) {
+				counterOvrflw = true;
+				break;
+			}
+			continue;
 		}
 
-		// Assure that measurement accuracy is good enough
-		TCNT2 = tcnt2Value;
-		if (TIFR2 & (1 << TOV2)) {
+		// Assure that no samples were lost
+		if (isSamplingOverrun()) {
 			// Error
 			accuracyOvrflw = true;
 			break;
 		}
 
 		// Check if key pressed
-		key = analogRead(0);
-		// Return immediately if something is pressed
-		if (key < LCD_KEY_PRESS_THRESHOLD) {
+		if (getSampledKeypad() < LCD_KEY_PRESS_THRESHOLD) {
+			// Return immediately if something is pressed
 			keyPressed = true;
 			break;
 		}
-
-		// Check for time out
-		if (TIFR1 & (1 << TOV1)) {
-			// Interrupt pending bit set -> Overflow happened.
-			// This means 4.19 seconds elapsed with no signal.
-			counterOvrflw = true;
-			break;
-		}
 	}
 
+#ifdef COMPARATOR_ENABLED
 L_ERROR:
+#endif
+	stopSampling();
+	stopTimebase();
+
 #ifdef OUT_PIN_BUTTON_COMPARE_TIME
 	if (outpValue)
 		digitalWrite(OUT_PIN_BUTTON_COMPARE_TIME, LOW);
 #endif
 
-	// Disable timer interrupts
-	TIMSK1 = 0;
-	TIMSK2 = 0;
-
-	// Enable interrupts
-	interrupts();
-
 	// Key pressed ? -> Abort
 	if (keyPressed) {
 		waitLcdKeyRelease();
 		abortAll = true;
+		return false;
 	}
 	else if (accuracyOvrflw) {    // Assure that measurement accuracy is good enough
 	  // Error
 		Error(F("Error:"), F(CHECK_ACCURACY_ERROR_STR));
+		return false;
 	}
-	else if (counterOvrflw) {    // Overflow?
-	  // Interrupt pending bit set -> Overflow happened.
-	  // This means 4.19 seconds elapsed with no signal.
+	else if (counterOvrflw) {    // Time out?
+	  // This means MEASURE_TIMEOUT elapsed with no signal.
 		Error(F("Error:"), F("No signal"));
+		return false;
+	}
+	else if (alreadyCrossed) {    // In range before the press?
+		Error(F("Already crossed:"), F("Check threshold"));
+		return false;
 	}
 
-	// Calculate time from counter value.
-	long tcount1l = tcount1;
-	tcount1l *= 64 * adjust;
-	tcount1l = (tcount1l + 500l) / 1000l; // with rounding
-
-	return (int)tcount1l;
+	// The times since the button press are measured from the switching
+	// of the contact (see Actuator.h).
+	if (waitTicks)
+		*waitTicks = compensateActuation(waitTime);
+	if (time < waitTime)
+		return false;	// inputPin was earlier than inputPinWait
+	if (inputPinWait >= 0)
+		ticks = time - waitTime;
+	else
+		ticks = compensateActuation(time);
+	return true;
 }
 
 
@@ -330,70 +777,133 @@ L_ERROR:
 // @param threshold The value to compare the inputPin value to.
 // @param positiveThreshold If true check that inputPin value is bigger, if false check that inputPin value is smaller.
 // @param threshold The value to to wait for (SVGA).
-// @return the time.
-int measureLagDiff(int threshold, bool positiveThreshold, int thresholdWait) {
-	return measureLag(IN_PIN_PHOTO_SENSOR, threshold, positiveThreshold, IN_PIN_SVGA, thresholdWait);
+// @param ticks Returns the time in timebase ticks.
+// @return false on error or abort (see measureLag()).
+bool measureLagDiff(int threshold, bool positiveThreshold, int thresholdWait, uint32_t& ticks) {
+	return measureLag(IN_PIN_PHOTO_SENSOR, threshold, positiveThreshold, ticks, IN_PIN_SVGA, thresholdWait);
 }
 
 
-// Calibrates the photo sensor and afterwards measure the
-// input lag for a few cycles.
-// Calibration:
-//   Simulate joystick button press -> measure min/max photo
-//   sensor value.
-//   Simulate joystick button unpress -> measure min/max photo
-//   sensor value.
-// Measurement:
-//   Simulate joystick button press -> measure time until photo
-//   sensor value changes.
-void measurePhotoSensor() {
-	// Show test title
+// Prints the min/max lag at the current cursor position.
+void printLagRange(const Statistics& stats) {
+	if (stats.getMin() != stats.getMax()) {
+		lcd.print(usToMsString(stats.getMin()));
+		lcd.print(F("-"));
+	}
+	lcd.print(usToMsString(stats.getMax()));
+	lcd.print(F("ms     "));
+}
+
+
+// Prints the average source lag (button -> SVGA) and the average
+// display lag (SVGA -> photo sensor) to the LCD.
+void printLagSplit(const Statistics& sourceStats, const Statistics& displayStats) {
 	lcd.clear();
-	lcd.print(F("Test: Button ->"));
+	lcd.print(F("Source: "));
+	lcd.print(usToMsString((long)sourceStats.getMean()));
+	lcd.print(F("ms"));
 	lcd.setCursor(0, 1);
-	lcd.print(F("-> Photosensor"));
-	waitMs(TITLE_TIME); if (isAbort()) return;
+	lcd.print(F("Display: "));
+	lcd.print(usToMsString((long)displayStats.getMean()));
+	lcd.print(F("ms"));
+}
 
-	// Calibrate
+
+// Prints the number of cycles and the 95% confidence interval
+// of the average (in ms) to the LCD.
+void printConfidence(const Statistics& stats) {
 	lcd.clear();
-	lcd.print(F("Calib. Photo S."));
-	// Simulate joystick button press
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOnLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, 1500);
-	if (isAbort()) return;
-	// Print
+	lcd.print(F("Cycles: "));
+	lcd.print(stats.getCount());
 	lcd.setCursor(0, 1);
-	lcd.print(buttonOnLight.min);
-	lcd.print(F("-"));
-	lcd.print(buttonOnLight.max);
-	// Simulate joystick button unpress
-	digitalWrite(OUT_PIN_BUTTON, LOW);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOffLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, 1500);
-	if (isAbort()) return;
-	// Print
+	lcd.print(F("95% CI: +-"));
+	lcd.print(usToMsString((long)stats.getConfidenceHalfWidth()));
+	lcd.print(F("ms"));
+}
+
+
+// Prints the median and the 95/99 percentiles (in ms) to the LCD.
+void printPercentiles(const Histogram& histogram) {
+	lcd.clear();
+	lcd.print(F("p50: "));
+	lcd.print(usToMsString(histogram.getPercentile(50)));
+	lcd.print(F("ms"));
 	lcd.setCursor(0, 1);
-	lcd.print(buttonOffLight.min);
-	lcd.print(F("-"));
-	lcd.print(buttonOffLight.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
+	lcd.print(F("p95/99:"));
+	lcd.print(usToMsString(histogram.getPercentile(95)));
+	lcd.print(F("/"));
+	lcd.print(usToMsString(histogram.getPercentile(99)));
+}
 
-	// Check values. They should not overlap.
-	bool overlap = (buttonOnLight.max >= buttonOffLight.min && buttonOnLight.min <= buttonOffLight.max);
-	if (overlap) {
-		// Error
-		Error(F("Calibr. Error:"), F("Ranges overlap"));
+
+// Prints the sampling statistics of the run to the LCD:
+// The samples per timed window and the min/mean/max time between
+// 2 samples (in us), i.e. the real resolution of the measurement.
+void printSamplingStats() {
+	const struct SamplingStats& stats = getSamplingStats();
+	lcd.clear();
+	lcd.print(F("Smp/cycle: "));
+	lcd.print((stats.cycles > 0) ? stats.samples / stats.cycles : 0);
+	lcd.setCursor(0, 1);
+	if (stats.intervals == 0) {
+		lcd.print(F("No samples"));
 		return;
 	}
+	char s[8];
+	lcd.print(ticksToUs(stats.minInterval));
+	lcd.print(F("/"));
+	dtostrf((double)stats.sumInterval / stats.intervals / TIMEBASE_TICKS_PER_US, 1, 1, s);
+	lcd.print(s);
+	lcd.print(F("/"));
+	lcd.print(ticksToUs(stats.maxInterval));
+	lcd.print(F("us"));
+}
+
+
+// Prints the sampling statistics of the run to serial.
+void serialPrintSamplingStats() {
+#ifdef SERIAL_IF_ENABLED
+	const struct SamplingStats& stats = getSamplingStats();
+	Serial.print(F("Samples/cycle\tmin\tmean\tmax (us):\t"));
+	Serial.print((stats.cycles > 0) ? stats.samples / stats.cycles : 0);
+	Serial.print(F("\t"));
+	Serial.print(ticksToUs(stats.minInterval));
+	Serial.print(F("\t"));
+	Serial.print((stats.intervals > 0) ? (double)stats.sumInterval / stats.intervals / TIMEBASE_TICKS_PER_US : 0.0);
+	Serial.print(F("\t"));
+	Serial.println(ticksToUs(stats.maxInterval));
+#endif
+}
+
+
+// Prints the median and the 95/99 percentiles (in ms) to serial.
+void serialPrintPercentiles(const Histogram& histogram) {
+#ifdef SERIAL_IF_ENABLED
+	Serial.print(F("p50\tp95\tp99 (ms):\t"));
+	Serial.print(usToMsString(histogram.getPercentile(50)));
+	Serial.print(F("\t"));
+	Serial.print(usToMsString(histogram.getPercentile(95)));
+	Serial.print(F("\t"));
+	Serial.println(usToMsString(histogram.getPercentile(99)));
+#endif
+}
 
-	// Calculate threshold in the middle (buttonOffLight value is bigger than buttonOnLight value)
-	int threshold = (buttonOnLight.max + buttonOffLight.min) / 2;
-	bool positiveThreshold = (buttonOnLight.max > buttonOffLight.max);
 
+// Measures the lag for up to COUNT_CYCLES cycles.
+// The run stops early if the average is known precisely enough,
+// i.e. if the 95% confidence interval is smaller than CI_TARGET_WIDTH.
+// Prints each result, the min/max and at the end the average, the percentiles
+// and the number of cycles.
+// A cycle in which inputPin was earlier than inputPinWait is repeated
+// (at most MAX_EARLY_CYCLES times per run), i.e. it does not use up a
+// cycle number.
+// @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
+// @param calib The calibration of inputPin. The thresholds are tracked between the cycles.
+// @param inputPinWait If >= 0: Wait for inputPinWait before starting the measurement. See measureLag().
+// @param thresholdWait The value to compare the inputPinWait value to.
+// @param avgTitle The text printed in front of the average.
+// @param mode The mode for the result stream, e.g. STREAM_MODE_PHOTO.
+void measureCycles(int inputPin, struct Calibration& calib, int inputPinWait, int thresholdWait, const __FlashStringHelper* avgTitle, uint8_t mode) {
 	// Print
 	lcd.clear();
 	lcd.print(F("Start testing..."));
@@ -403,9 +913,14 @@ void measurePhotoSensor() {
 	lcd.print(F("Lag: "));
 
 	// Measure a few cycles
-	struct MinMax timeRange = { 1023, 0 };
-	float avg = 0.0;
-	for (int i = 1; i <= COUNT_CYCLES; i++) {
+	streamRunStart(mode);
+	startStimulusSchedule();
+	resetSamplingStats();
+	Statistics stats;
+	Statistics waitStats;	// Lag until the 2nd trigger
+	Histogram histogram(500);	// 0.5ms bins
+	uint8_t earlyCount = 0;
+	for (int i = 1; i <= COUNT_CYCLES;) {
 		// Print
 		lcd.setCursor(0, 0);
 		lcd.print(i);
@@ -413,171 +928,148 @@ void measurePhotoSensor() {
 		lcd.print(COUNT_CYCLES);
 		lcd.print(F(": "));
 
-		// Wait until input (photo sensor) changes
-		int time = measureLag(IN_PIN_PHOTO_SENSOR, threshold, positiveThreshold);
+		// Wait until input changes
+		uint32_t waitTicks;
+		uint32_t ticks;
+		bool valid = measureLag(inputPin, calib.threshold, calib.positiveThreshold, ticks, inputPinWait, thresholdWait, &waitTicks);
 		if (isAbort()) return;
+		if (!valid) {
+			// inputPin was earlier than the 2nd trigger: the cycle is repeated
+			if (++earlyCount > MAX_EARLY_CYCLES) {
+				Error(F("Too often early:"), F("Check 2nd trigger"));
+				return;
+			}
+			lcd.print(F("Early!  "));
+			waitInput(inputPin, calib, getNextStimulusDelay());
+			if (isAbort()) return;
+			continue;
+		}
+		streamCycle(mode, i, ticks, calib.threshold, thresholdWait, calib.positiveThreshold, 0, waitTicks);
+		long time = ticksToUs(ticks);
 		// Output result:
-		lcd.print(time);
+		lcd.print(usToMsString(time));
 		lcd.print(F("ms     "));
 
-		// Wait a random time to make sure we really get different results.
-		int waitRnd = random(70, 150);
-		// Wait until input (photo sensor) changes
-		waitMsInput(IN_PIN_PHOTO_SENSOR, threshold, !positiveThreshold, waitRnd);
-		if (isAbort()) return;
-
-		// Calculate max/min.
-		if (time > timeRange.max)
-			timeRange.max = time;
-		if (time < timeRange.min)
-			timeRange.min = time;
+		// Calculate average, max/min and distribution
+		stats.add(time);
+		histogram.add(time);
+		if (inputPinWait >= 0)
+			waitStats.add(ticksToUs(waitTicks));
 
 		// Print min/max result
 		lcd.setCursor(5, 1);
-		if (timeRange.min != timeRange.max) {
-			lcd.print(timeRange.min);
-			lcd.print(F("-"));
-		}
-		lcd.print(timeRange.max);
-		lcd.print(F("ms     "));
+		printLagRange(stats);
+
+		// Stop if the average is exact enough
+		if (stats.isConverged(MIN_COUNT_CYCLES, CI_TARGET_WIDTH))
+			break;
+		i++;
 
-		// Calculate average
-		avg += time;
+		// Wait until input changes. The next press is shifted in phase
+		// to make sure we really get different results.
+		waitInput(inputPin, calib, getNextStimulusDelay());
+		if (isAbort()) return;
 	}
 
-	// Print average:
-	avg /= COUNT_CYCLES;
-	lcd.setCursor(0, 0);
-	lcd.print(F("Avg Phot: "));
-	lcd.print((int)avg);
-	lcd.print(F("ms     "));
+	streamRunEnd(mode, stats.getCount());
+	serialPrintPercentiles(histogram);
+	serialPrintSamplingStats();
 
-	// Wait on key press.
-	while (getLcdKey() != LCD_KEY_NONE);
+	// Show the results until a key is pressed:
+	// Average and min/max, the percentiles, the number of cycles, the
+	// sampling statistics, the lag in frames if the frame period is known
+	// and the split into source and display lag if there is a 2nd trigger.
+	uint8_t page = 0;
+	while (true) {
+		switch (page) {
+			case 0:
+				lcd.clear();
+				lcd.print(avgTitle);
+				lcd.print(usToMsString((long)stats.getMean()));
+				lcd.print(F("ms"));
+				lcd.setCursor(0, 1);
+				lcd.print(F("Lag: "));
+				printLagRange(stats);
+				break;
+			case 1:
+				printPercentiles(histogram);
+				break;
+			case 2:
+				printConfidence(stats);
+				break;
+			case 3:
+				printSamplingStats();
+				break;
+			case 4:
+				printFrames(stats);
+				break;
+			default:
+				printLagSplit(waitStats, stats);
+				break;
+		}
+		waitMs(RESULT_PAGE_TIME); if (isAbort()) return;
+		// Next page, skip the pages that are not available
+		do {
+			page = (page + 1) % 6;
+		} while ((page == 4 && getFramePeriod() <= 0.0) || (page == 5 && inputPinWait < 0));
+	}
 }
 
 
-
-// Calibrates the AD2 (SVGA) input and measures the
+// Calibrates the photo sensor and afterwards measure the
 // input lag for a few cycles.
-// This is normally used for the SVGA input but can also be tied to other outputs
-// like the Teensy digital out from the FastestJoystick project).
-// For SVGA: Uses the blue-output of SVGA (but you could also use red or green).
 // Calibration:
-//   Simulate joystick button press -> measure svga brightness, i.e. max signal.
-//   Simulate joystick button unpress -> measure svga darkness, i.e. max signal.
+//   Simulate joystick button press -> measure min/max photo
+//   sensor value.
+//   Simulate joystick button unpress -> measure min/max photo
+//   sensor value.
 // Measurement:
-//   Simulate joystick button press -> measure time until svga value changes
-void measureAD2() {
+//   Simulate joystick button press -> measure time until photo
+//   sensor value changes.
+void measurePhotoSensor() {
 	// Show test title
 	lcd.clear();
 	lcd.print(F("Test: Button ->"));
 	lcd.setCursor(0, 1);
-	lcd.print(F("-> AD2 (eg.SVGA)"));
+	lcd.print(F("-> Photosensor"));
 	waitMs(TITLE_TIME); if (isAbort()) return;
 
 	// Calibrate
-	lcd.clear();
-	lcd.print(F("Calibrate AD2"));
-	// Simulate joystick button press
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
-	waitMs(500); if (isAbort()) return;
-	// Get max svga value
-	struct MinMax buttonOnSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOnSVGA.max);
-	// Simulate joystick button unpress
-	digitalWrite(OUT_PIN_BUTTON, LOW);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOffSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOffSVGA.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
+	struct Calibration calib;
+	if (!calibratePhotoSensor(calib))
+		return;
 
-	// Print diff
-	lcd.setCursor(0, 1);
-	lcd.print(F("Diff="));
-	lcd.print(buttonOnSVGA.max - buttonOffSVGA.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
+	// Measure
+	measureCycles(IN_PIN_PHOTO_SENSOR, calib, -1, 0, F("Avg Phot: "), STREAM_MODE_PHOTO);
+}
 
-	// Check values. They should differ clearly. (Should be around 100.)
-	if (buttonOnSVGA.max - buttonOffSVGA.max < SVGA_MIN_DIFF) {
-		// Error
-		Error(F("Calibr. Error:"), F("Signal too weak"));
-		return;
-	}
 
-	// Calculate threshold in the middle
-	int threshold = (buttonOnSVGA.max + buttonOffSVGA.max) / 2;
-	bool positiveThreshold = (buttonOnSVGA.max > buttonOffSVGA.max);
 
-	// Print
-	lcd.clear();
-	lcd.print(F("Start testing..."));
-	waitMs(1000); if (isAbort()) return;
+// Calibrates the AD2 (SVGA) input and measures the
+// input lag for a few cycles.
+// This is normally used for the SVGA input but can also be tied to other outputs
+// like the Teensy digital out from the FastestJoystick project).
+// For SVGA: Uses the blue-output of SVGA (but you could also use red or green).
+// Calibration:
+//   Simulate joystick button press -> measure svga brightness, i.e. max signal.
+//   Simulate joystick button unpress -> measure svga darkness, i.e. max signal.
+// Measurement:
+//   Simulate joystick button press -> measure time until svga value changes
+void measureAD2() {
+	// Show test title
 	lcd.clear();
+	lcd.print(F("Test: Button ->"));
 	lcd.setCursor(0, 1);
-	lcd.print(F("Lag: "));
-
-	// Measure a few cycles
-	struct MinMax timeRange = { 1023, 0 };
-	float avg = 0.0;
-	for (int i = 1; i <= COUNT_CYCLES; i++) {
-		// Print
-		lcd.setCursor(0, 0);
-		lcd.print(i);
-		lcd.print(F("/"));
-		lcd.print(COUNT_CYCLES);
-		lcd.print(F(": "));
-
-		// Wait until input (svga) changes
-		int time = measureLag(IN_PIN_SVGA, threshold, positiveThreshold);
-		if (isAbort()) return;
-		// Output result:
-		lcd.print(time);
-		lcd.print(F("ms     "));
-
-		// Wait a random time to make sure we really get different results.
-		int waitRnd = random(70, 150);
-		// Wait until input (svga) changes
-		waitMsInput(IN_PIN_SVGA, threshold, !positiveThreshold, waitRnd);
-		if (isAbort()) return;
-
-		// Calculate max/min.
-		if (time > timeRange.max)
-			timeRange.max = time;
-		if (time < timeRange.min)
-			timeRange.min = time;
-
-		// Print min/max result
-		lcd.setCursor(5, 1);
-		if (timeRange.min != timeRange.max) {
-			lcd.print(timeRange.min);
-			lcd.print(F("-"));
-		}
-		lcd.print(timeRange.max);
-		lcd.print(F("ms     "));
-
-		// Calculate average
-		avg += time;
-	}
+	lcd.print(F("-> AD2 (eg.SVGA)"));
+	waitMs(TITLE_TIME); if (isAbort()) return;
 
-	// Print average:
-	avg /= COUNT_CYCLES;
-	lcd.setCursor(0, 0);
-	lcd.print(F("Avg SVGA: "));
-	lcd.print((int)avg);
-	lcd.print(F("ms     "));
+	// Calibrate
+	struct Calibration calib;
+	if (!calibrateAD2(calib, true))
+		return;
 
-	// Wait on key press.
-	while (getLcdKey() != LCD_KEY_NONE);
+	// Measure
+	measureCycles(IN_PIN_SVGA, calib, -1, 0, F("Avg SVGA: "), STREAM_MODE_SVGA);
 }
 
 
@@ -595,6 +1087,8 @@ void measureAD2() {
 // Measurement:
 //   Simulate joystick button press -> measure time when svga value changes
 //   to time when photo sensor changes.
+//   Both inputs are sampled in the same cycle, so each cycle gives the
+//   source lag (button -> SVGA) and the display lag (SVGA -> photo sensor).
 void measureSvgaToMonitor() {
 	// Show test title
 	lcd.clear();
@@ -604,146 +1098,15 @@ void measureSvgaToMonitor() {
 	waitMs(TITLE_TIME); if (isAbort()) return;
 
 	// Calibrate
-	lcd.clear();
-	lcd.print(F("Calibrate SVGA"));
-	// Simulate joystick button press
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
-	waitMs(500); if (isAbort()) return;
-	// Get max svga value
-	struct MinMax buttonOnSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOnSVGA.max);
-	// Simulate joystick button unpress
-	digitalWrite(OUT_PIN_BUTTON, LOW);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOffSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOffSVGA.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
-
-	// Print diff
-	lcd.setCursor(0, 1);
-	lcd.print(F("Diff="));
-	lcd.print(buttonOnSVGA.max - buttonOffSVGA.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
-
-	// Check values. They should differ clearly. (Should be around 100.)
-	if (buttonOnSVGA.max - buttonOffSVGA.max < SVGA_MIN_DIFF) {
-		// Error
-		Error(F("Calibr. Error:"), F("Signal too weak"));
+	struct Calibration calibSVGA;
+	if (!calibrateAD2(calibSVGA, true))
 		return;
-	}
-
-	// Calibrate
-	lcd.clear();
-	lcd.print(F("Calib. Photo S."));
-	// Simulate joystick button press
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOnLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOnLight.min);
-	lcd.print(F("-"));
-	lcd.print(buttonOnLight.max);
-	// Simulate joystick button unpress
-	digitalWrite(OUT_PIN_BUTTON, LOW);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOffLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOffLight.min);
-	lcd.print(F("-"));
-	lcd.print(buttonOffLight.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
-
-	// Check values. They should not overlap.
-	bool overlap = (buttonOnLight.max >= buttonOffLight.min && buttonOnLight.min <= buttonOffLight.max);
-	if (overlap) {
-		// Error
-		Error(F("Calibr. Error:"), F("Ranges overlap"));
+	struct Calibration calib;
+	if (!calibratePhotoSensor(calib))
 		return;
-	}
-
-	// Calculate threshold in the middle (buttonOffLight value is bigger than buttonOnLight value)
-	int threshold = (buttonOnLight.max + buttonOffLight.min) / 2;
-	bool positiveThreshold = (buttonOnLight.max > buttonOffLight.max);
-
-	// Calculate threshold in the middle
-	int thresholdWait = (buttonOnSVGA.max + buttonOffSVGA.max) / 2;
-
-	// Print
-	lcd.clear();
-	lcd.print(F("Start testing..."));
-	waitMs(1000); if (isAbort()) return;
-	lcd.clear();
-	lcd.setCursor(0, 1);
-	lcd.print(F("Lag: "));
-
-	// Measure a few cycles
-	struct MinMax timeRange = { 1023, 0 };
-	float avg = 0.0;
-	for (int i = 1; i <= COUNT_CYCLES; i++) {
-		// Print
-		lcd.setCursor(0, 0);
-		lcd.print(i);
-		lcd.print(F("/"));
-		lcd.print(COUNT_CYCLES);
-		lcd.print(F(": "));
-
-		// Wait until input (photo sensor) changes
-		int time = measureLagDiff(threshold, positiveThreshold, thresholdWait);
-		if (isAbort()) return;
-		// Output result:
-		lcd.print(time);
-		lcd.print(F("ms     "));
-
-		// Wait a random time to make sure we really get different results.
-		int waitRnd = random(70, 150);
-		// Wait until input (photo sensor) changes
-		waitMsInput(IN_PIN_PHOTO_SENSOR, threshold, !positiveThreshold, waitRnd);
-		if (isAbort()) return;
-
-		// Calculate max/min.
-		if (time > timeRange.max)
-			timeRange.max = time;
-		if (time < timeRange.min)
-			timeRange.min = time;
-
-		// Print min/max result
-		lcd.setCursor(5, 1);
-		if (timeRange.min != timeRange.max) {
-			lcd.print(timeRange.min);
-			lcd.print(F("-"));
-		}
-		lcd.print(timeRange.max);
-		lcd.print(F("ms     "));
 
-		// Calculate average
-		avg += time;
-	}
-
-	// Print average:
-	avg /= COUNT_CYCLES;
-	lcd.setCursor(0, 0);
-	lcd.print(F("Avg Mon: "));
-	lcd.print((int)avg);
-	lcd.print(F("ms     "));
-
-	// Wait on key press.
-	while (getLcdKey() != LCD_KEY_NONE);
+	// Measure
+	measureCycles(IN_PIN_PHOTO_SENSOR, calib, IN_PIN_SVGA, calibSVGA.threshold, F("Avg Mon: "), STREAM_MODE_MONITOR);
 }
 
 
@@ -751,116 +1114,111 @@ void measureSvgaToMonitor() {
 
 
 // Waits until the photo sensor (or SVGA value) value gets into range.
+// The button is released after pressTime. The input is sampled by the
+// free running ADC (see Sampler.cpp).
 // @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
-// @param pressTime The time he button press is simulated.
+// @param pressTime The time he button press is simulated (in ms).
 // @param threshold The value to compare the inputPin value to.
 // @param positiveThreshold If true check that inputPin value is bigger, if false check that inputPin value is smaller.
 // @param maxMeasureTime In ms. The function is left after this time (if no signal is found).
-// @return -1 if no reaction was found. Otherwise the used time.
-int checkReactionWithPressTime(int inputPin, int pressTime, int threshold, bool positiveThreshold, int maxMeasureTime) {
-	int key = 1023;
-	unsigned int tcount1 = 0;
+// @return -1 if no reaction was found. Otherwise the time since the button press in timebase ticks.
+long checkReactionWithPressTime(int inputPin, int pressTime, int threshold, bool positiveThreshold, int maxMeasureTime) {
+	struct Sample sample;
+	struct Sample prevSample = { 0, 0, SAMPLE_CHANNEL_NONE };
+	uint32_t time = 0;
 	bool accuracyOvrflw = false;
 	bool counterOvrflw = false;
 	bool keyPressed = false;
+	bool alreadyCrossed = false;
 
-	// Turnoff interrupts.
-	noInterrupts();
-
-	const int adjust = 16000000 / F_CPU;  // 1 for 16MHz, 2 for 8MHz.
-	const int tcnt2Value = 256 - (CHECK_ACCURACY / 0.064 / adjust); // 2ms
-	const int tcnt1ValueOff = -(int)(((float)pressTime) / 0.064 / adjust);
-	const int tcnt1ValueTooLong = -(int)(((float)maxMeasureTime) / 0.064 / adjust);
-	bool switchOff = true;
-
-	/*
-	  Serial.print(F("tcnt1ValueOff="));
-	  Serial.println(tcnt1ValueOff);
-	  Serial.print(F("tcnt1ValueTooLong="));
-	  Serial.println(tcnt1ValueTooLong);
-	*/
-
-	// 16Mhz, prescaler = 1024
-	// 1024/16000000 = 0.000064s = 64us
-	// 65536*0.000064s = 4.2s max
-
-	// Setup timer 1 (16 bit timer) to measure the time:
-	// Prescaler: 1024 -> resolution 64us (at F_CPU=16MHz).
-	// No timer compare register.
-	TCCR1A = 0; // No PWM
-	TCCR1B = (1 << CS10) | (1 << CS12);  // Prescaler = 1024
-	TIMSK1 = 1 << TOIE1;  // For polling only
-
-	// Setup timer 2 (8 bit timer) to check measurement accuracy:
-	// Prescaler: 1024 -> resolution 64us (at F_CPU=16MHz).
-	// No timer compare register.
-	TCCR2A = 0; // No PWM
-	TCCR2B = (1 << CS10) | (1 << CS12);  // Prescaler = 1024
-	TIFR2 = 1 << TOV2;  // Clear pending bits
-	TIMSK2 = 1 << TOIE2;  // For polling only
-
-	// Reset timer
-	TCNT2 = tcnt2Value;
-	TCNT1 = tcnt1ValueOff;
-	TIFR1 = 1 << TOV1;  // Clear pending bits
-	TIFR2 = 1 << TOV2;  // Clear pending bits
+	const uint32_t ticksOff = usToTicks(pressTime * 1000l);
+	const uint32_t ticksTooLong = ticksOff + usToTicks(maxMeasureTime * 1000l);
 
-	// Simulate joystick button
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
+	// Setup timer 1 to measure the time (resolution 0.5us at F_CPU=16MHz).
+	startTimebase();
 
+#ifdef COMPARATOR_ENABLED
+	if (!startComparator(inputPin, threshold, positiveThreshold)) {
+		stopTimebase();
+		Error(F("Comparator:"), F("Check reference"));
+		return -1;
+	}
+#endif
+
+	// Simulate joystick button and reset timer.
+	// The button is released by the timer (see Button.h).
+	resetTimebaseWithButton(true);
+	scheduleButtonRelease(ticksOff);
+
+#ifdef COMPARATOR_ENABLED
+	// Wait until the crossing is captured.
+	// The keypad is read in between (see readKeypadDuringCapture()).
+	const uint32_t keypadInterval = usToTicks(COMPARATOR_KEYPAD_INTERVAL * 1000l);
+	uint32_t keypadTime = keypadInterval;
+	while (!isComparatorCaptured()) {
+		uint32_t now = getTimebase();
+		// Check for time out
+		if (now >= ticksTooLong) {
+			// This means maxMeasureTime elapsed with no signal.
+			counterOvrflw = true;
+			break;
+		}
+		// Check if key pressed
+		if (now >= keypadTime) {
+			if (readKeypadDuringCapture() < LCD_KEY_PRESS_THRESHOLD) {
+				keyPressed = true;
+				break;
+			}
+			keypadTime = now + keypadInterval;
+		}
+	}
+	time = getComparatorCaptureTime();
+	alreadyCrossed = isComparatorAlreadyCrossed();
+	accuracyOvrflw = isComparatorCaptureLost();
+	stopComparator();
+#else
+	startSampling(inputPin);
 	while (true) {
 		// Check range of input pin
-		int value = analogRead(inputPin);
-		// Check for threshold
-		if ((positiveThreshold && value > threshold) // Check if value is bigger
-			|| (!positiveThreshold && value < threshold)) // Check if value is smaller
-		{
-			tcount1 = TCNT1;
-			break;
+		if (getSample(sample)) {
+			// Check for threshold
+			if ((positiveThreshold && sample.value > threshold) // Check if value is bigger
+				|| (!positiveThreshold && sample.value < threshold)) // Check if value is smaller
+			{
+				// Interpolate between the last sample before and the first after the crossing
+				time = interpolateCrossing(prevSample, sample, threshold);
+				break;
+			}
+			prevSample = sample;
+			// Check for time out.
+			// Note: The sample time is used so that interrupts are not
+			// disabled to read the timebase.
+			if (sample.time >= ticksTooLong) {
+				// This means maxMeasureTime elapsed with no signal.
+				counterOvrflw = true;
+				break;
+			}
+			continue;
 		}
 
-		// Assure that measurement accuracy is good enough
-		TCNT2 = tcnt2Value;
-		if (TIFR2 & (1 << TOV2)) {
+		// Assure that no samples were lost
+		if (isSamplingOverrun()) {
 			// Error
 			accuracyOvrflw = true;
 			break;
 		}
 
 		// Check if key pressed
-		key = analogRead(0);
-		// Check if something is pressed
-		if (key < LCD_KEY_PRESS_THRESHOLD) {
+		if (getSampledKeypad() < LCD_KEY_PRESS_THRESHOLD) {
 			// key pressed -> abort
 			keyPressed = true;
 			break;
 		}
-
-		// Check for time out
-		if (TIFR1 & (1 << TOV1)) {
-			// Interrupt pending bit set -> Overflow happened.
-			// Check mode:
-			if (switchOff) {
-				// Switch button off
-				digitalWrite(OUT_PIN_BUTTON, LOW);
-				switchOff = false;
-				TCNT1 = tcnt1ValueTooLong;
-				TIFR1 = 1 << TOV1;  // Clear pending bits
-			}
-			else {
-				// This means maxMeasureTime elapsed with no signal.
-				counterOvrflw = true;
-				break;
-			}
-		}
 	}
 
-	// Disable timer interrupts
-	TIMSK1 = 0;
-	TIMSK2 = 0;
-
-	// Enable interrupts
-	interrupts();
+	stopSampling();
+#endif
+	stopTimebase();
 
 	// Key pressed ? -> Abort
 	if (keyPressed) {
@@ -876,13 +1234,13 @@ int checkReactionWithPressTime(int inputPin, int pressTime, int threshold, bool
 	else if (counterOvrflw) {
 		return -1;
 	}
+	else if (alreadyCrossed) {    // In range before the press?
+		Error(F("Already crossed:"), F("Check threshold"));
+		return -1;
+	}
 
-	// Calculate time from counter value.
-	long tcount1l = tcount1 - ((switchOff) ? tcnt1ValueOff : tcnt1ValueTooLong);
-	tcount1l *= 64 * adjust;
-	tcount1l = (tcount1l + 500l) / 1000l; // with rounding
-
-	return (int)tcount1l;
+	// Measure from the switching of the contact (see Actuator.h)
+	return compensateActuation(time);
 }
 
 
@@ -893,7 +1251,7 @@ int checkKeyToChangePressTime(int key = LCD_KEY_NONE) {
 	// Check if we need to read the key press
 	if (key == LCD_KEY_NONE) {
 		// Get key
-		key = getLcdKey();
+		key = readLcdKey();
 	}
 
 	// Check which key is pressed
@@ -910,128 +1268,22 @@ int checkKeyToChangePressTime(int key = LCD_KEY_NONE) {
 }
 
 
-// Calibrates photo sensor and SVGA output and measures the
-// minimal time that the button needs to be pressed to be recognized
-// by the system (i.e. the emulator).
-// Since the normal polling time of an emulator should be 20ms (or 17ms for US) this should be the result.
-// This method verifies this assumption.
-//
-// Pseudo code:
-// 1. Start with button-press (relais close) time of 1ms
-// 2. Do 100x test
-// 3. If one of the tests fail then increase close-time by 1ms and start at 2
-// 4. If all 100 tests pass the minimum time has been found.
-//
-// A test lasts until either an SVGA signal or the photo sensor signal is
-// found. For convenience the user needs to conenct only one of both.
-// If no signal is found for 300ms the test has failed.
-void measureMinPressTime() {
-	// Show test title
-	lcd.clear();
-	lcd.print(F("Test: Minimum"));
-	lcd.setCursor(0, 1);
-	lcd.print(F("Button Press"));
-	waitMs(TITLE_TIME); if (isAbort()) return;
-
-	// Calibrate
-	lcd.clear();
-	lcd.print(F("Calibrate SVGA"));
-	// Simulate joystick button press
-	digitalWrite(OUT_PIN_BUTTON, HIGH);
-	waitMs(500); if (isAbort()) return;
-	// Get max svga value
-	struct MinMax buttonOnSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOnSVGA.max);
-	// Simulate joystick button unpress
-	digitalWrite(OUT_PIN_BUTTON, LOW);
-	waitMs(500); if (isAbort()) return;
-	// Get max/min light value
-	struct MinMax buttonOffSVGA = getMaxMinAnalogIn(IN_PIN_SVGA, 1500);
-	if (isAbort()) return;
-	// Print
-	lcd.setCursor(0, 1);
-	lcd.print(buttonOffSVGA.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
-
-	// Print diff
-	lcd.setCursor(0, 1);
-	lcd.print(F("Diff="));
-	lcd.print(buttonOnSVGA.max - buttonOffSVGA.max);
-	lcd.print(F("         "));
-	waitMs(1000); if (isAbort()) return;
-
-	// Check if SVGA signal can be used
-	bool useSVGA = (buttonOnSVGA.max - buttonOffSVGA.max >= SVGA_MIN_DIFF);
-	//Serial.println(F("SVGA"));
-	//Serial.println(buttonOnSVGA.max);
-	//Serial.println(buttonOffSVGA.max);
-	int threshold;
-	int pin;
-
-	if (useSVGA) {
-		// Use SVGA threshold
-		threshold = (buttonOnSVGA.max + buttonOffSVGA.max) / 2;
-		pin = IN_PIN_SVGA;
-	}
-	else {
-		// Calibrate photo sensor
-		lcd.clear();
-		lcd.print(F("Calib. Photo S."));
-		// Simulate joystick button press
-		digitalWrite(OUT_PIN_BUTTON, HIGH);
-		waitMs(500); if (isAbort()) return;
-		// Get max/min light value
-		struct MinMax buttonOnLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, 1500);
-		if (isAbort()) return;
-		// Print
-		lcd.setCursor(0, 1);
-		lcd.print(buttonOnLight.min);
-		lcd.print(F("-"));
-		lcd.print(buttonOnLight.max);
-		// Simulate joystick button unpress
-		digitalWrite(OUT_PIN_BUTTON, LOW);
-		waitMs(500); if (isAbort()) return;
-		// Get max/min light value
-		struct MinMax buttonOffLight = getMaxMinAnalogIn(IN_PIN_PHOTO_SENSOR, 1500);
-		if (isAbort()) return;
-		// Print
-		lcd.setCursor(0, 1);
-		lcd.print(buttonOffLight.min);
-		lcd.print(F("-"));
-		lcd.print(buttonOffLight.max);
-		lcd.print(F("         "));
-		waitMs(1000); if (isAbort()) return;
-
-		// Check values. They should not overlap.
-		bool overlap = (buttonOnLight.max >= buttonOffLight.min && buttonOnLight.min <= buttonOffLight.max);
-		if (overlap) {
-			// Error
-			Error(F("Calibr. Error:"), F("Ranges overlap"));
-			return;
-		}
-
-		// Calculate threshold in the middle (buttonOffLight value is bigger than buttonOnLight value)
-		threshold = (buttonOnLight.max + buttonOffLight.min) / 2;
-		pin = IN_PIN_PHOTO_SENSOR;
-	}
-
-	// Print
-	lcd.clear();
-	lcd.print(F("Start testing..."));
-	waitMs(1000); if (isAbort()) return;
-	lcd.clear();
-
-	// Measure: Start with 1ms
-	int pressTime = 1; //15;
+// Runs the minimum press time test "forever" with a fixed press time,
+// e.g. to check over a day that the system really catches all presses.
+// The press time can be changed with the keys (see checkKeyToChangePressTime()).
+// For each press time the number of presses and the time until the first
+// missed press is shown.
+// @param pin The input to check, IN_PIN_SVGA or IN_PIN_PHOTO_SENSOR.
+// @param calib The calibration of the input.
+// @param pressTime The press time to start with (in ms).
+static void soakPressTime(int pin, struct Calibration& calib, int pressTime) {
 	unsigned long startTime;
 	unsigned long offsetTime;
 	char s[9 + 1];
 	unsigned long maxTime = 0;
 	unsigned long totalTime = 0;
+	uint32_t streamIndex = 0;
+	lcd.clear();
 	while (true) {
 		int pressDiff = 1;
 		// Print
@@ -1050,13 +1302,13 @@ void measureMinPressTime() {
 			// Check range of input pin
 			int value = analogRead(pin);
 			// Check for threshold
-			if (!((useSVGA && value > threshold) // Check if value is bigger
-				|| (!useSVGA && value < threshold))) // Check if value is smaller
+			if (!((calib.positiveThreshold && value > calib.threshold) // Check if value is bigger
+				|| (!calib.positiveThreshold && value < calib.threshold))) // Check if value is smaller
 				break;  // Leave loop
 			  // Check for keypress
-			int key = analogRead(0);
-			if (key < LCD_KEY_PRESS_THRESHOLD) {
-				pressDiff = checkKeyToChangePressTime();
+			int key = getLcdKey();
+			if (key != LCD_KEY_NONE) {
+				pressDiff = checkKeyToChangePressTime(key);
 				if (pressDiff == 0) {
 					// Other key pressed
 					abortAll = true;
@@ -1079,12 +1331,12 @@ void measureMinPressTime() {
 			}
 
 			// Wait until input changes
-			int time = checkReactionWithPressTime(pin, pressTime, threshold, useSVGA, 300);
+			long ticks = checkReactionWithPressTime(pin, pressTime, calib.threshold, calib.positiveThreshold, 300);
 			// Check key
-			if (time < 0) {
-				int key = analogRead(0);
-				if (key < LCD_KEY_PRESS_THRESHOLD) {
-					pressDiff = checkKeyToChangePressTime();
+			if (ticks < 0) {
+				int key = readLcdKey();
+				if (key != LCD_KEY_NONE) {
+					pressDiff = checkKeyToChangePressTime(key);
 					if (pressDiff == 0) {
 						// Other key pressed
 						abortAll = true;
@@ -1093,12 +1345,11 @@ void measureMinPressTime() {
 				}
 				break;
 			}
+			streamCycle(STREAM_MODE_MIN_PRESS, ++streamIndex, ticks, calib.threshold, 0, calib.positiveThreshold, pressTime);
 
-			// Wait a random time to make sure we really get different results.
-			int waitRnd = random(40, 150);
-			// waitRnd = random(1*1000, 3*1000);
-			   // Wait until input changes
-			int key = waitMsInput(IN_PIN_SVGA, threshold, !useSVGA, waitRnd);
+			// Wait until input changes. The next press is shifted in phase
+			// to make sure we really get different results.
+			int key = waitInput(pin, calib, getNextStimulusDelay());
 			// Check for keypress
 			if (key != LCD_KEY_NONE) {
 				pressDiff = checkKeyToChangePressTime(key);
@@ -1112,9 +1363,9 @@ void measureMinPressTime() {
 			if (abortAll)
 				return;
 
-			// Calculate time
-			offsetTime += time;
-			totalTime = millis() - startTime + offsetTime;
+			// Calculate time (millis is stopped during the measurement)
+			offsetTime += ticksToUs(ticks);
+			totalTime = millis() - startTime + offsetTime / 1000l;
 			totalTime /= 1000l;  // in secs
 
 			// Print count and time, e.g. "4k 1h"
@@ -1152,3 +1403,378 @@ void measureMinPressTime() {
 	}
 }
 
+
+// Presses the button 'trials' times for pressTime and counts the presses
+// the system reacts on.
+// @param pin The input to check, IN_PIN_SVGA or IN_PIN_PHOTO_SENSOR.
+// @param calib The calibration of the input.
+// @param pressTime The press time (in ms).
+// @param trials The number of presses.
+// @param title Printed in the 1rst line together with the press time.
+// @param stopAtMiss If true the function returns at the first missed press.
+// @param cycle Counts the recognized presses of the run (for the result stream).
+// @param mode The mode for the result stream, e.g. STREAM_MODE_MIN_PRESS.
+// @return The number of recognized presses. -1 if a key was pressed (or error).
+static int pressTrials(int pin, struct Calibration& calib, int pressTime, uint16_t trials, const __FlashStringHelper* title, bool stopAtMiss, uint32_t& cycle, uint8_t mode) {
+	lcd.clear();
+	lcd.print(title);
+	lcd.print(pressTime);
+	lcd.print(F("ms"));
+	int count = 0;
+	for (uint16_t i = 1; i <= trials; i++) {
+		// Print
+		lcd.setCursor(0, 1);
+		lcd.print(i);
+		lcd.print(F("/"));
+		lcd.print(trials);
+		lcd.print(F("   "));
+
+		// Make sure that there is no signal. The next press is shifted in phase
+		// to make sure we really get different results.
+		if (waitInput(pin, calib, getNextStimulusDelay()) != LCD_KEY_NONE)
+			return -1;
+		if (isAbort())
+			return -1;
+
+		// Press and check for the reaction
+		long ticks = checkReactionWithPressTime(pin, pressTime, calib.threshold, calib.positiveThreshold, 300);
+		if (ticks < 0) {
+			// Key pressed?
+			if (readLcdKey() != LCD_KEY_NONE || isAbort()) {
+				waitLcdKeyRelease();
+				abortAll = true;
+				return -1;
+			}
+			if (stopAtMiss)
+				break;
+			continue;
+		}
+		count++;
+		streamCycle(mode, ++cycle, ticks, calib.threshold, 0, calib.positiveThreshold, pressTime);
+	}
+	return count;
+}
+
+
+// Calibrates the input for the press time tests.
+// Uses SVGA if the signal is strong enough, otherwise the photo sensor.
+// @param calib The calibration is returned here.
+// @return The input pin, IN_PIN_SVGA or IN_PIN_PHOTO_SENSOR. -1 on error or abort.
+static int calibrateReaction(struct Calibration& calib) {
+	if (calibrateAD2(calib, false))
+		return IN_PIN_SVGA;
+	if (isAbort())
+		return -1;
+	if (!calibratePhotoSensor(calib))
+		return -1;
+	return IN_PIN_PHOTO_SENSOR;
+}
+
+
+// Returns the number of presses required to confirm with a confidence of
+// MIN_PRESS_CONFIDENCE that less than MIN_PRESS_FAILURE_RATE of the
+// presses are missed: if all n presses are recognized
+// then (1-rate)^n <= 1-confidence, i.e. n = ln(1-confidence)/ln(1-rate).
+static uint16_t getConfirmationTrials() {
+	double n = log(1.0 - MIN_PRESS_CONFIDENCE / 100.0) / log(1.0 - MIN_PRESS_FAILURE_RATE / 100.0);
+	return (uint16_t)ceil(n);
+}
+
+
+// Calibrates photo sensor and SVGA output and measures the
+// minimal time that the button needs to be pressed to be recognized
+// by the system (i.e. the emulator).
+// Since the normal polling time of an emulator should be 20ms (or 17ms for US) this should be the result.
+// This method verifies this assumption.
+//
+// Pseudo code:
+// 1. Search: Start with a press time of 1ms and double it until
+//    MIN_PRESS_PROBE_TRIALS presses are all recognized.
+// 2. Bisection: Halve the interval between the last missed and the
+//    recognized press time (MIN_PRESS_PROBE_TRIALS presses each) until it is 1ms.
+// 3. Confirmation: Press getConfirmationTrials() times. If a press is
+//    missed increase the press time by 1ms and confirm again.
+// Afterwards the result is shown. UP starts an endless test with
+// the found press time (see soakPressTime()).
+//
+// A test lasts until either an SVGA signal or the photo sensor signal is
+// found. For convenience the user needs to conenct only one of both.
+// If no signal is found for 300ms the test has failed.
+void measureMinPressTime() {
+	// Show test title
+	lcd.clear();
+	lcd.print(F("Test: Minimum"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("Button Press"));
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+	// Calibrate
+	struct Calibration calib;
+	int pin = calibrateReaction(calib);
+	if (pin < 0)
+		return;
+
+	// Print
+	lcd.clear();
+	lcd.print(F("Start testing..."));
+	waitMs(1000); if (isAbort()) return;
+	streamRunStart(STREAM_MODE_MIN_PRESS);
+	startStimulusSchedule();
+	resetSamplingStats();
+	uint32_t cycle = 0;
+	int result;
+
+	// 1. Search: Double the press time until all presses are recognized
+	int lo = 0;	// Press time with a missed press (0 = none yet)
+	int hi = 1;	// Press time with all presses recognized
+	while ((result = pressTrials(pin, calib, hi, MIN_PRESS_PROBE_TRIALS, F("Search: "), true, cycle, STREAM_MODE_MIN_PRESS)) != MIN_PRESS_PROBE_TRIALS) {
+		if (result < 0)
+			return;
+		lo = hi;
+		hi *= 2;
+		if (hi > MIN_PRESS_MAX_TIME) {
+			Error(F("Min. press time:"), F("No reaction"));
+			return;
+		}
+	}
+
+	// 2. Bisection
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		result = pressTrials(pin, calib, mid, MIN_PRESS_PROBE_TRIALS, F("Bisect: "), true, cycle, STREAM_MODE_MIN_PRESS);
+		if (result < 0)
+			return;
+		if (result == MIN_PRESS_PROBE_TRIALS)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	// 3. Confirmation
+	const uint16_t confirmTrials = getConfirmationTrials();
+	while ((result = pressTrials(pin, calib, hi, confirmTrials, F("Confirm: "), true, cycle, STREAM_MODE_MIN_PRESS)) != confirmTrials) {
+		if (result < 0)
+			return;
+		hi++;
+		if (hi > MIN_PRESS_MAX_TIME) {
+			Error(F("Min. press time:"), F("Not reliable"));
+			return;
+		}
+	}
+	streamRunEnd(STREAM_MODE_MIN_PRESS, cycle);
+	serialPrintSamplingStats();
+
+	// Print to serial
+#ifdef SERIAL_IF_ENABLED
+	Serial.print(F("Min. press time (ms):\t"));
+	Serial.println(hi);
+#endif
+
+	// Show result until a key is pressed
+	lcd.clear();
+	lcd.print(F("Min press: "));
+	lcd.print(hi);
+	lcd.print(F("ms"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("miss<"));
+	lcd.print(MIN_PRESS_FAILURE_RATE);
+	lcd.print(F("% @"));
+	lcd.print(MIN_PRESS_CONFIDENCE);
+	lcd.print(F("%"));
+	// Wait on key. getLcdKey() executes the tasks (waitMs() must not be
+	// used here: isAbort() would consume the key press).
+	int key;
+	do {
+		key = getLcdKey();
+	} while (key == LCD_KEY_NONE);
+	waitLcdKeyRelease();
+
+	// Continue with the endless test
+	if (key == KEY_MEASURE_MIN_UP1) {
+		abortAll = false;
+		soakPressTime(pin, calib, hi);
+	}
+	abortAll = true;
+}
+
+
+// The sums of the least squares fit of the poll period ramp.
+struct RampSums {
+	uint16_t count;
+	double sumD;
+	double sumP;
+	double sumDD;
+	double sumDP;
+	double sumD2Var;	// Sum of d^2 * var(p)
+	double sumDVar;	// Sum of d * var(p)
+	double sumVar;	// Sum of var(p)
+};
+
+
+// Adds a point of the poll period ramp to the sums.
+// The variance uses p = (hits + 0.5) / (n + 1), so that the saturated
+// points (0 or n hits) don't get a variance of 0.
+// @param pressTime The press time in ms.
+// @param hits The number of recognized presses out of POLL_SWEEP_TRIALS.
+static void addRampPoint(struct RampSums& sums, int pressTime, int hits) {
+	double d = pressTime;
+	double p = (double)hits / POLL_SWEEP_TRIALS;
+	double pv = (hits + 0.5) / (POLL_SWEEP_TRIALS + 1);
+	double var = pv * (1.0 - pv) / POLL_SWEEP_TRIALS;
+	sums.count++;
+	sums.sumD += d;
+	sums.sumP += p;
+	sums.sumDD += d * d;
+	sums.sumDP += d * p;
+	sums.sumD2Var += d * d * var;
+	sums.sumDVar += d * var;
+	sums.sumVar += var;
+}
+
+
+// Fits the success probability over the press time to get the poll
+// period of the system. A press of time d is recognized if a poll happens
+// while the button is pressed, i.e. with probability (d-d0)/T for d0 < d < d0+T
+// (T = poll period, d0 = e.g. debounce/switch delay), clipped to 0 and 1.
+// The press time is increased in 1ms steps from 1ms. For each press time
+// POLL_SWEEP_TRIALS presses are done until the ramp has clearly been
+// crossed, i.e. until the press times are recognized always for a
+// quarter of the ramp width (at least POLL_SWEEP_MIN_FULL in a row).
+// The slope b of the ramp is fitted by least squares. All points from the
+// last point without hits before the ramp up to the first point that is
+// recognized always after it are used, i.e. also the saturated points
+// inside the ramp. The standard error of the slope uses the binomial
+// variance p(1-p)/n of each point (see addRampPoint()).
+// Result: T = 1/b with a 95% confidence interval of +-1.96*SE(b)/b^2.
+void measurePollPeriod() {
+	// Show test title
+	lcd.clear();
+	lcd.print(F("Test: Poll"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("Period"));
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+	// Calibrate
+	struct Calibration calib;
+	int pin = calibrateReaction(calib);
+	if (pin < 0)
+		return;
+
+	// Print
+	lcd.clear();
+	lcd.print(F("Start testing..."));
+	waitMs(1000); if (isAbort()) return;
+	streamRunStart(STREAM_MODE_POLL_PERIOD);
+	startStimulusSchedule();
+	resetSamplingStats();
+	uint32_t cycle = 0;
+
+	// Sweep the press time and sum up the ramp points
+	struct RampSums sums = { 0 };
+	int lastZero = 0;	// Last press time without hits before the ramp (0 = none)
+	int firstHit = 0;	// First press time with hits (0 = none yet)
+	int fullStart = 0;	// First press time of the trailing points that are recognized always (0 = none)
+	for (int pressTime = 1; ; pressTime++) {
+		if (pressTime > MIN_PRESS_MAX_TIME) {
+			Error(F("Poll period:"), F("No reaction"));
+			return;
+		}
+		int hits = pressTrials(pin, calib, pressTime, POLL_SWEEP_TRIALS, F("Sweep: "), false, cycle, STREAM_MODE_POLL_PERIOD);
+		if (hits < 0)
+			return;
+
+		// Print to serial
+#ifdef SERIAL_IF_ENABLED
+		Serial.print(pressTime);
+		Serial.print(F("\t"));
+		Serial.println(hits);
+#endif
+
+		// Before the ramp only the last point without hits is used
+		if (firstHit == 0) {
+			if (hits == 0) {
+				lastZero = pressTime;
+				continue;
+			}
+			firstHit = pressTime;
+			if (lastZero > 0)
+				addRampPoint(sums, lastZero, 0);
+		}
+
+		if (hits == POLL_SWEEP_TRIALS) {
+			// Stop if the ramp has clearly been crossed
+			if (fullStart == 0)
+				fullStart = pressTime;
+			int fullCount = pressTime - fullStart + 1;
+			if (fullCount >= max(POLL_SWEEP_MIN_FULL, (fullStart - firstHit) / 4))
+				break;
+			continue;
+		}
+
+		// The points recognized always before were inside the ramp
+		for (; fullStart > 0 && fullStart < pressTime; fullStart++)
+			addRampPoint(sums, fullStart, POLL_SWEEP_TRIALS);
+		fullStart = 0;
+		addRampPoint(sums, pressTime, hits);
+	}
+	// The first point after the ramp
+	addRampPoint(sums, fullStart, POLL_SWEEP_TRIALS);
+	streamRunEnd(STREAM_MODE_POLL_PERIOD, cycle);
+	serialPrintSamplingStats();
+
+	// Fit
+	uint16_t count = sums.count;
+	if (count < 2) {
+		Error(F("Poll period:"), F("Ramp too steep"));
+		return;
+	}
+	double sxx = sums.sumDD - sums.sumD * sums.sumD / count;
+	double slope = (sums.sumDP - sums.sumD * sums.sumP / count) / sxx;
+	if (slope <= 0.0) {
+		Error(F("Poll period:"), F("No ramp"));
+		return;
+	}
+	double meanD = sums.sumD / count;
+	// var(slope) = sum((d-meanD)^2 * var(p)) / sxx^2
+	double varSlope = (sums.sumD2Var - 2.0 * meanD * sums.sumDVar + meanD * meanD * sums.sumVar) / (sxx * sxx);
+	double period = 1.0 / slope;	// in ms
+	double halfWidth = 1.96 * sqrt(varSlope) / (slope * slope);
+	double offset = meanD - (sums.sumP / count) / slope;	// d0, in ms
+
+	// Print to serial
+#ifdef SERIAL_IF_ENABLED
+	Serial.print(F("Poll period (ms):\t"));
+	Serial.print(period);
+	Serial.print(F("\t+-"));
+	Serial.println(halfWidth);
+#endif
+
+	// Show the results until a key is pressed:
+	// The poll period and the offset.
+	char s[12];
+	uint8_t page = 0;
+	while (true) {
+		lcd.clear();
+		if (page == 0) {
+			lcd.print(F("Poll: "));
+			dtostrf(period, 1, 1, s);
+			lcd.print(s);
+			lcd.print(F("ms"));
+			lcd.setCursor(0, 1);
+			lcd.print(F("95% CI: +-"));
+			dtostrf(halfWidth, 1, 1, s);
+			lcd.print(s);
+		}
+		else {
+			lcd.print(F("Offset: "));
+			dtostrf(offset, 1, 1, s);
+			lcd.print(s);
+			lcd.print(F("ms"));
+			lcd.setCursor(0, 1);
+			lcd.print(F("Ramp points: "));
+			lcd.print(count);
+		}
+		waitMs(RESULT_PAGE_TIME); if (isAbort()) return;
+		page = (page + 1) % 2;
+	}
+}
@@ -1,6 +1,9 @@
 #ifndef __Measure_H__
 #define __Measure_H__
 
+#include "Histogram.h"
+#include "Statistics.h"
+
 // Structure to return min/max values.
 struct MinMax {
 	int16_t min;
@@ -13,12 +16,39 @@ struct MinMaxFloat {
 	double max;
 };
 
+// Result of the calibration of an input.
+// The thresholds form a hysteresis between the edges of the ranges
+// (see setThresholds()). The edges are tracked between the cycles of
+// a measurement (see waitInput()).
+struct Calibration {
+	int threshold;	// The value to compare the input to (button press)
+	bool positiveThreshold;	// true if the input gets bigger on button press
+	int levelOn;	// Typical value while the button is pressed
+	int levelOff;	// Typical value while the button is released
+	int thresholdRelease;	// The value to compare the input to (button release)
+	int edgeOn;	// Value of the pressed range next to the released range
+	int edgeOff;	// Value of the released range next to the pressed range
+	bool peakLevels;	// true if the edges are the max. values of the ranges (SVGA)
+};
+
 
 void setupMeasurement();
+struct MinMax getMaxMinAnalogIn(int inputPin, int measTime, int stableTime = 0);
+bool calibratePhotoSensor(struct Calibration& calib);
+bool calibrateAD2(struct Calibration& calib, bool showError);
+int waitInput(int inputPin, int threshold, bool positiveThreshold, unsigned long waitTime);
+int waitInput(int inputPin, struct Calibration& calib, unsigned long waitTime);
+void setThresholds(struct Calibration& calib);
 void testPhotoSensor();
 void measurePhotoSensor();
 void measureAD2();
 void measureSvgaToMonitor();
 void measureMinPressTime();
+void measurePollPeriod();
+void printPercentiles(const Histogram& histogram);
+void serialPrintPercentiles(const Histogram& histogram);
+void printConfidence(const Statistics& stats);
+void printSamplingStats();
+void serialPrintSamplingStats();
 
 #endif
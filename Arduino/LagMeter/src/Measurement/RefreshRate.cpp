@@ -0,0 +1,321 @@
+#include "RefreshRate.h"
+#include "Utilities.h"
+#include "Common.h"
+#include "Measure.h"
+#include "Sampler.h"
+#include "Timebase.h"
+#include "Stimulus.h"
+
+
+// The event times (in ticks) and their type (bit i: event i is a falling edge).
+static uint32_t eventTimes[REFRESH_EVENTS];
+static uint8_t eventTypes[REFRESH_EVENTS / 8];
+
+// The detected frame period in us. 0 if not known.
+static float framePeriod = 0.0;
+
+// The minimum diff required between dark and bright.
+#define REFRESH_MIN_DIFF  20
+
+
+// Returns the type (0 or 1) of an event.
+static inline uint8_t getEventType(uint8_t i) {
+	return (eventTypes[i >> 3] >> (i & 7)) & 1;
+}
+
+
+// Timestamps REFRESH_EVENTS events of the input.
+// @param inputPin IN_PIN_SVGA: start of vertical blanking.
+// IN_PIN_PHOTO_SENSOR: both edges.
+// @param threshold The middle between dark and bright.
+// @param hysteresis The distance from the threshold to detect dark or bright.
+// @return false on error or abort.
+static bool captureEvents(int inputPin, int threshold, int hysteresis) {
+	struct Sample sample;
+	const uint32_t timeout = usToTicks(MEASURE_TIMEOUT * 1000l);
+	const uint32_t vblankMin = usToTicks(REFRESH_VBLANK_MIN_US);
+	const bool svga = (inputPin == IN_PIN_SVGA);
+	uint8_t count = 0;
+	bool first = true;
+	bool bright = false;
+	uint32_t darkTime = 0;
+	bool accuracyOvrflw = false;
+	bool counterOvrflw = false;
+	bool keyPressed = false;
+
+	memset(eventTypes, 0, sizeof(eventTypes));
+	startTimebase();
+	startSampling(inputPin);
+	while (count < REFRESH_EVENTS) {
+		if (getSample(sample)) {
+			// Check for time out
+			if (sample.time > timeout) {
+				counterOvrflw = true;
+				break;
+			}
+
+			// Schmitt trigger
+			bool newBright = bright;
+			if (sample.value > threshold + hysteresis)
+				newBright = true;
+			else if (sample.value < threshold - hysteresis)
+				newBright = false;
+			if (newBright == bright)
+				continue;
+			bright = newBright;
+			uint32_t edgeTime = sample.time;
+
+			// The first edge is not used, its history is not known
+			if (first) {
+				first = false;
+				darkTime = edgeTime;
+				continue;
+			}
+
+			if (svga) {
+				// Start of vertical blanking: the dark period needs to be long enough
+				if (!bright) {
+					darkTime = edgeTime;
+					continue;
+				}
+				if (edgeTime - darkTime < vblankMin)
+					continue;
+				eventTimes[count++] = darkTime;
+			}
+			else {
+				// Photo sensor: both edges
+				if (!bright)
+					eventTypes[count >> 3] |= 1 << (count & 7);
+				eventTimes[count++] = edgeTime;
+			}
+			continue;
+		}
+
+		// Assure that no samples were lost
+		if (isSamplingOverrun()) {
+			accuracyOvrflw = true;
+			break;
+		}
+
+		// Check if key pressed
+		if (getSampledKeypad() < LCD_KEY_PRESS_THRESHOLD) {
+			keyPressed = true;
+			break;
+		}
+	}
+
+	stopSampling();
+	stopTimebase();
+
+	if (keyPressed) {
+		waitLcdKeyRelease();
+		abortAll = true;
+		return false;
+	}
+	if (accuracyOvrflw) {
+		Error(F("Error:"), F(CHECK_ACCURACY_ERROR_STR));
+		return false;
+	}
+	if (counterOvrflw) {
+		Error(F("Error:"), F("No signal"));
+		return false;
+	}
+	return true;
+}
+
+
+// Returns the median of the intervals between consecutive events
+// of the same type (in ticks). 0 if there are none.
+static uint32_t getMedianInterval() {
+	const uint8_t maxCount = 15;
+	uint32_t intervals[maxCount];
+	uint8_t n = 0;
+	for (uint8_t type = 0; type < 2; type++) {
+		int16_t prev = -1;
+		for (uint8_t i = 0; i < REFRESH_EVENTS && n < maxCount; i++) {
+			if (getEventType(i) != type)
+				continue;
+			if (prev >= 0) {
+				// Insertion sort
+				uint32_t interval = eventTimes[i] - eventTimes[prev];
+				uint8_t k = n++;
+				while (k > 0 && intervals[k - 1] > interval) {
+					intervals[k] = intervals[k - 1];
+					k--;
+				}
+				intervals[k] = interval;
+			}
+			prev = i;
+		}
+	}
+	if (n == 0)
+		return 0;
+	return intervals[n / 2];
+}
+
+
+// Calculates the period of the events by a least squares fit of the
+// event times over the event numbers. Missing events are skipped by
+// numbering the events with the help of the rough (median) period.
+// The fit is done per event type with a common slope.
+// @return The period in ticks or 0 if the events are not periodic.
+static float fitPeriod() {
+	uint32_t roughPeriod = getMedianInterval();
+	if (roughPeriod == 0)
+		return 0.0;
+
+	// Number the events
+	uint16_t numbers[REFRESH_EVENTS];
+	float sumXY = 0.0;
+	float sumXX = 0.0;
+	float means[2][2];	// [type][k, t]
+	for (uint8_t type = 0; type < 2; type++) {
+		int16_t firstEvent = -1;
+		uint8_t n = 0;
+		float sumK = 0.0;
+		float sumT = 0.0;
+		for (uint8_t i = 0; i < REFRESH_EVENTS; i++) {
+			if (getEventType(i) != type)
+				continue;
+			if (firstEvent < 0)
+				firstEvent = i;
+			uint32_t dt = eventTimes[i] - eventTimes[firstEvent];
+			numbers[i] = (dt + roughPeriod / 2) / roughPeriod;
+			sumK += numbers[i];
+			sumT += dt;
+			n++;
+		}
+		if (n == 0)
+			continue;
+		float meanK = sumK / n;
+		float meanT = sumT / n;
+		means[type][0] = meanK;
+		means[type][1] = meanT;
+		for (uint8_t i = 0; i < REFRESH_EVENTS; i++) {
+			if (getEventType(i) != type)
+				continue;
+			float dk = numbers[i] - meanK;
+			float dt = (float)(eventTimes[i] - eventTimes[firstEvent]) - meanT;
+			sumXY += dk * dt;
+			sumXX += dk * dk;
+		}
+	}
+	if (sumXX == 0.0)
+		return 0.0;
+	float period = sumXY / sumXX;
+
+	// Check the residuals. The events should deviate less than 1/8 period from the fit.
+	for (uint8_t type = 0; type < 2; type++) {
+		int16_t firstEvent = -1;
+		for (uint8_t i = 0; i < REFRESH_EVENTS; i++) {
+			if (getEventType(i) != type)
+				continue;
+			if (firstEvent < 0)
+				firstEvent = i;
+			float dt = (float)(eventTimes[i] - eventTimes[firstEvent]) - means[type][1];
+			float residual = dt - period * (numbers[i] - means[type][0]);
+			if (fabs(residual) > period / 8)
+				return 0.0;
+		}
+	}
+	return period;
+}
+
+
+// Returns the detected frame period in us. 0 if not known.
+float getFramePeriod() {
+	return framePeriod;
+}
+
+
+// Converts a time in us into a string in frames with 2 decimals.
+// The returned string is statically allocated, i.e. it is overwritten
+// when the function is used the 2nd time.
+// @param time The time to convert in us.
+// @return A string, e.g. "2.07". "?" if the frame period is not known.
+char* usToFramesString(long time) {
+	static char fs[8 + 1];
+	if (framePeriod <= 0.0) {
+		strcpy(fs, "?");
+		return fs;
+	}
+	long hundredths = (long)(time * 100.0 / framePeriod + 0.5);
+	snprintf(fs, sizeof(fs), "%ld.%02ld", hundredths / 100l, hundredths % 100l);
+	return fs;
+}
+
+
+// Prints the average and the min/max lag in frames to the LCD.
+void printFrames(const Statistics& stats) {
+	lcd.clear();
+	lcd.print(F("Avg: "));
+	lcd.print(usToFramesString((long)stats.getMean()));
+	lcd.print(F(" frames"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("Lag: "));
+	if (stats.getMin() != stats.getMax()) {
+		lcd.print(usToFramesString(stats.getMin()));
+		lcd.print(F("-"));
+	}
+	lcd.print(usToFramesString(stats.getMax()));
+}
+
+
+// Measures the frame period (see RefreshRate.h) and shows it until a
+// key is pressed. The period is used for the following measurements.
+// @param inputPin IN_PIN_SVGA or IN_PIN_PHOTO_SENSOR.
+void measureRefreshRate(int inputPin) {
+	// Show test title
+	bool svga = (inputPin == IN_PIN_SVGA);
+	lcd.clear();
+	lcd.print(F("Refresh rate"));
+	lcd.setCursor(0, 1);
+	if (svga)
+		lcd.print(F("-> AD2 (eg.SVGA)"));
+	else
+		lcd.print(F("-> Photosensor"));
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+	// Get the dark and bright level
+	lcd.clear();
+	lcd.print(F("Measuring..."));
+	digitalWrite(OUT_PIN_BUTTON, LOW);
+	struct MinMax range = getMaxMinAnalogIn(inputPin, 500);
+	if (isAbort()) return;
+	if (range.max - range.min < REFRESH_MIN_DIFF) {
+		Error(F("Refresh:"), F("Signal too weak"));
+		return;
+	}
+	int threshold = (range.min + range.max) / 2;
+	int hysteresis = (range.max - range.min) / 4;
+
+	// Timestamp the frames and fit the period
+	if (!captureEvents(inputPin, threshold, hysteresis))
+		return;
+	float period = fitPeriod() / TIMEBASE_TICKS_PER_US;
+	if (!svga)
+		period /= REFRESH_PHOTO_FRAMES;
+	if (period <= 0.0) {
+		Error(F("Refresh:"), F("Not periodic"));
+		return;
+	}
+
+	// Store
+	framePeriod = period;
+	setStimulusPeriod((unsigned long)(period + 0.5));
+
+	// Show result until key pressed
+	lcd.clear();
+	lcd.print(F("Frame: "));
+	char s[12];
+	dtostrf(period / 1000.0, 1, 3, s);
+	lcd.print(s);
+	lcd.print(F("ms"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("Rate:  "));
+	dtostrf(1000000.0 / period, 1, 2, s);
+	lcd.print(s);
+	lcd.print(F("Hz"));
+	while (!isAbort())
+		waitMs(100);
+}
@@ -0,0 +1,37 @@
+#ifndef __RefreshRate_H__
+#define __RefreshRate_H__
+
+#include <Arduino.h>
+#include "Statistics.h"
+
+
+// Detects the frame period of the display (or of the SVGA output).
+// SVGA: The start of each vertical blanking is timestamped, i.e. the start
+//   of a dark period longer than REFRESH_VBLANK_MIN_US. The screen should
+//   be bright (at least the lower part).
+// Photo sensor: Both edges of the light are timestamped. The screen needs to
+//   toggle black/white with every frame, i.e. each edge repeats every
+//   REFRESH_PHOTO_FRAMES frames.
+// The period is the slope of a least squares fit of the event times over
+// the event (frame) numbers. With REFRESH_EVENTS events the error is far
+// below 1us.
+// The detected period is used for the stimulus schedule and to show
+// the results in frames. It is lost at reset.
+
+// Number of events that are timestamped.
+#define REFRESH_EVENTS  48
+
+// Min. length of the vertical blanking (SVGA). Dark periods during
+// the horizontal blanking are much shorter.
+#define REFRESH_VBLANK_MIN_US  300
+
+// Frames between 2 rising (or falling) edges of the photo sensor.
+#define REFRESH_PHOTO_FRAMES  2
+
+
+void measureRefreshRate(int inputPin);
+float getFramePeriod();
+char* usToFramesString(long time);
+void printFrames(const Statistics& stats);
+
+#endif
@@ -0,0 +1,253 @@
+#include "ResponseTime.h"
+#include "Utilities.h"
+#include "Common.h"
+#include "Measure.h"
+#include "Sampler.h"
+#include "Timebase.h"
+#include "Button.h"
+#include "Actuator.h"
+#include "Statistics.h"
+#include "ResultStream.h"
+#include "Stimulus.h"
+
+
+// The crossings measured for each transition (in percent of the level change).
+static const uint8_t crossingPercents[RESPONSE_CROSSINGS] = { 10, 50, 90 };
+
+
+// Max. half-width of the noise band of a level (in percent of the level change).
+// Otherwise the 10% and 90% crossings could be triggered by the noise.
+#define RESPONSE_MAX_NOISE_PERCENT  10
+
+
+// Returns true if the noise bands of both levels are narrow enough,
+// i.e. the distance from a level to the edge of its range is at most
+// RESPONSE_MAX_NOISE_PERCENT of the distance between the levels.
+static bool isNoiseSmall(const struct Calibration& calib) {
+	long maxNoise = (long)abs(calib.levelOn - calib.levelOff) * RESPONSE_MAX_NOISE_PERCENT / 100;
+	return (abs(calib.levelOn - calib.edgeOn) <= maxNoise && abs(calib.levelOff - calib.edgeOff) <= maxNoise);
+}
+
+
+// Switches the button and measures the time until the input crosses
+// 10%, 50% and 90% of the way from one calibrated level to the other.
+// @param inputPin Pin from which the analog input is read.
+// @param calib The calibration (levels) of the input.
+// @param press true: press the button (off -> on level), false: release it (on -> off level).
+// @param times The times of the crossings (in ticks since the button change) are returned here.
+// @return false on error or abort.
+static bool measureTransition(int inputPin, const struct Calibration& calib, bool press, uint32_t times[RESPONSE_CROSSINGS]) {
+	struct Sample sample;
+	struct Sample prevSample = { 0, 0, SAMPLE_CHANNEL_NONE };
+	const uint32_t timeout = usToTicks(MEASURE_TIMEOUT * 1000l);
+	bool accuracyOvrflw = false;
+	bool counterOvrflw = false;
+	bool keyPressed = false;
+
+	// Calculate the levels
+	int from = (press) ? calib.levelOff : calib.levelOn;
+	int to = (press) ? calib.levelOn : calib.levelOff;
+	bool rising = (to > from);
+	int levels[RESPONSE_CROSSINGS];
+	for (uint8_t i = 0; i < RESPONSE_CROSSINGS; i++)
+		levels[i] = from + (long)(to - from) * crossingPercents[i] / 100;
+
+	// Setup timer 1 to measure the time (resolution 0.5us at F_CPU=16MHz).
+	startTimebase();
+
+	// Simulate joystick button and reset timer
+	resetTimebaseWithButton(press);
+
+	startSampling(inputPin);
+	uint8_t crossed = 0;
+	while (crossed < RESPONSE_CROSSINGS) {
+		if (getSample(sample)) {
+			// Check the next crossings. A fast transition may pass several
+			// levels with one sample. The times are interpolated between
+			// the samples.
+			while (crossed < RESPONSE_CROSSINGS
+				&& ((rising && sample.value > levels[crossed])
+				|| (!rising && sample.value < levels[crossed])))
+			{
+				times[crossed] = interpolateCrossing(prevSample, sample, levels[crossed]);
+				crossed++;
+			}
+			prevSample = sample;
+			// Check for time out
+			if (sample.time > timeout) {
+				counterOvrflw = true;
+				break;
+			}
+			continue;
+		}
+
+		// Assure that no samples were lost
+		if (isSamplingOverrun()) {
+			accuracyOvrflw = true;
+			break;
+		}
+
+		// Check if key pressed
+		if (getSampledKeypad() < LCD_KEY_PRESS_THRESHOLD) {
+			keyPressed = true;
+			break;
+		}
+	}
+
+	stopSampling();
+	stopTimebase();
+
+	if (keyPressed) {
+		waitLcdKeyRelease();
+		abortAll = true;
+		return false;
+	}
+	if (accuracyOvrflw) {
+		Error(F("Error:"), F(CHECK_ACCURACY_ERROR_STR));
+		return false;
+	}
+	if (counterOvrflw) {
+		// E.g. the level is not reached completely
+		Error(F("Error:"), F("No signal"));
+		return false;
+	}
+	// Measure from the switching of the contact
+	for (uint8_t i = 0; i < RESPONSE_CROSSINGS; i++)
+		times[i] = compensateActuation(times[i], press);
+	return true;
+}
+
+
+// Prints the average of the stats in ms at the current cursor position.
+static void printAvg(const Statistics& stats) {
+	lcd.print(usToMsString((long)stats.getMean()));
+	lcd.print(F("ms  "));
+}
+
+
+// Calibrates the photo sensor and afterwards measures the
+// press and the release transition for a few cycles.
+// For each transition the 10%, 50% and 90% crossings are measured.
+// Results:
+//   Lag: button press -> 10% crossing (processing lag)
+//   Rise/Fall: 10% -> 90% crossing for the brighter/darker transition (response time)
+void measureResponseTime() {
+	// Show test title
+	lcd.clear();
+	lcd.print(F("Test: Response"));
+	lcd.setCursor(0, 1);
+	lcd.print(F("time 10-90%"));
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+	// Calibrate
+	struct Calibration calib;
+	if (!calibratePhotoSensor(calib))
+		return;
+	if (!isNoiseSmall(calib)) {
+		Error(F("Response:"), F("Signal too noisy"));
+		return;
+	}
+
+	// Print
+	lcd.clear();
+	lcd.print(F("Start testing..."));
+	waitMs(1000); if (isAbort()) return;
+	lcd.clear();
+
+	// The press transition is the rising one if the 'on' level is bigger
+	bool pressRising = (calib.levelOn > calib.levelOff);
+
+	// Measure a few cycles
+	streamRunStart(STREAM_MODE_RESPONSE);
+	resetSamplingStats();
+	startStimulusSchedule();
+	Statistics lagStats;
+	Statistics riseStats;
+	Statistics fallStats;
+	for (int i = 1; i <= COUNT_CYCLES; i++) {
+		// Print
+		lcd.setCursor(0, 0);
+		lcd.print(i);
+		lcd.print(F("/"));
+		lcd.print(COUNT_CYCLES);
+		lcd.print(F(": "));
+
+		// Wait with released button. The press is shifted in phase.
+		waitInput(IN_PIN_PHOTO_SENSOR, calib, getNextStimulusDelay());
+		if (isAbort()) return;
+
+		// Press
+		uint32_t pressTimes[RESPONSE_CROSSINGS];
+		if (!measureTransition(IN_PIN_PHOTO_SENSOR, calib, true, pressTimes))
+			return;
+
+		// Wait with pressed button until the level is reached.
+		// The release is shifted in phase as well.
+		waitUs(getNextStimulusDelay()); if (isAbort()) return;
+
+		// Release
+		uint32_t releaseTimes[RESPONSE_CROSSINGS];
+		if (!measureTransition(IN_PIN_PHOTO_SENSOR, calib, false, releaseTimes))
+			return;
+		streamResponse(STREAM_MODE_RESPONSE, i, pressTimes, releaseTimes);
+
+		// Calculate
+		long lag = ticksToUs(pressTimes[0]);
+		long pressResponse = ticksToUs(pressTimes[2] - pressTimes[0]);
+		long releaseResponse = ticksToUs(releaseTimes[2] - releaseTimes[0]);
+		lagStats.add(lag);
+		if (pressRising) {
+			riseStats.add(pressResponse);
+			fallStats.add(releaseResponse);
+		}
+		else {
+			riseStats.add(releaseResponse);
+			fallStats.add(pressResponse);
+		}
+
+		// Print
+		lcd.print(usToMsString(lag));
+		lcd.print(F("ms     "));
+		lcd.setCursor(0, 1);
+		lcd.print(F("R:"));
+		lcd.print(usToMsString((long)riseStats.getMean()));
+		lcd.print(F(" F:"));
+		lcd.print(usToMsString((long)fallStats.getMean()));
+		lcd.print(F("      "));
+
+		// Stop if the averages are exact enough
+		if (lagStats.isConverged(MIN_COUNT_CYCLES, CI_TARGET_WIDTH)
+			&& riseStats.isConverged(MIN_COUNT_CYCLES, CI_TARGET_WIDTH)
+			&& fallStats.isConverged(MIN_COUNT_CYCLES, CI_TARGET_WIDTH))
+			break;
+	}
+	digitalWrite(OUT_PIN_BUTTON, LOW);
+	streamRunEnd(STREAM_MODE_RESPONSE, lagStats.getCount());
+	serialPrintSamplingStats();
+
+	// Show the results until a key is pressed:
+	// Processing lag, the response times and the sampling statistics.
+	uint8_t page = 0;
+	while (true) {
+		lcd.clear();
+		if (page == 2) {
+			printSamplingStats();
+		}
+		else if (page == 1) {
+			lcd.print(F("Rise: "));
+			printAvg(riseStats);
+			lcd.setCursor(0, 1);
+			lcd.print(F("Fall: "));
+			printAvg(fallStats);
+		}
+		else {
+			lcd.print(F("Proc.lag:"));
+			printAvg(lagStats);
+			lcd.setCursor(0, 1);
+			lcd.print(F("(10%) n="));
+			lcd.print(lagStats.getCount());
+		}
+		waitMs(RESULT_PAGE_TIME); if (isAbort()) return;
+		page = (page + 1) % 3;
+	}
+}
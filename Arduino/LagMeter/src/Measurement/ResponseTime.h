@@ -0,0 +1,19 @@
+#ifndef __ResponseTime_H__
+#define __ResponseTime_H__
+
+#include <Arduino.h>
+#include "StreamProtocol.h"
+
+
+// Measures the 10%, 50% and 90% crossings of the photo sensor
+// for the press (button on) and the release (button off) transition.
+// The lag until the 10% crossing is the processing lag of the display
+// (and the system), the time from 10% to 90% is the pixel response time.
+
+// Number of crossings per transition (10%, 50%, 90%).
+#define RESPONSE_CROSSINGS  STREAM_RESPONSE_CROSSINGS
+
+
+void measureResponseTime();
+
+#endif
@@ -0,0 +1,197 @@
+#include "ResultStream.h"
+#include "Common.h"
+#include "Timebase.h"
+#include "RefreshRate.h"
+#include "Sampler.h"
+
+
+#ifdef RESULT_STREAM_ENABLED
+
+#ifdef SERIAL_IF_ENABLED
+#error "RESULT_STREAM_ENABLED and SERIAL_IF_ENABLED use the same serial port."
+#endif
+
+// Size of the transmit ring buffer. Must be a power of 2.
+// Holds about 5 cycle records, i.e. enough for the time between 2 measurements.
+#define STREAM_BUFFER_SIZE  128
+
+// The transmit ring buffer.
+static uint8_t streamBuffer[STREAM_BUFFER_SIZE];
+static uint8_t streamHead;
+static uint8_t streamTail;
+// Number of records dropped since the last run start.
+static uint16_t streamDropped;
+
+
+// Encodes the record (plus CRC) with COBS and puts the frame
+// into the ring buffer.
+// @param record Pointer to the record.
+// @param size The size of the record. Max. STREAM_MAX_RECORD_SIZE.
+// @param wait If true the frame is transmitted until there is enough space
+// in the buffer. If false the record is dropped if the buffer is full.
+// @return false if the buffer was full. The record is dropped.
+static bool writeRecord(const void* record, uint8_t size, bool wait = false) {
+	// Append CRC
+	uint8_t data[STREAM_MAX_RECORD_SIZE + 2];
+	memcpy(data, record, size);
+	uint16_t crc = streamCrc16(data, size);
+	data[size++] = crc & 0xFF;
+	data[size++] = crc >> 8;
+
+	// COBS encoding: each code byte is the distance to the next zero.
+	// The frame is short (< 254 bytes), so no additional code bytes are required.
+	uint8_t frame[STREAM_MAX_FRAME_SIZE];
+	uint8_t codeIndex = 0;
+	uint8_t code = 1;
+	uint8_t len = 1;
+	for (uint8_t i = 0; i < size; i++) {
+		if (data[i] == 0) {
+			frame[codeIndex] = code;
+			codeIndex = len++;
+			code = 1;
+		}
+		else {
+			frame[len++] = data[i];
+			code++;
+		}
+	}
+	frame[codeIndex] = code;
+	frame[len++] = 0;  // Delimiter
+
+	// Check for space. The frame is written completely or not at all.
+	uint8_t space = (streamTail - streamHead - 1) & (STREAM_BUFFER_SIZE - 1);
+	while (wait && len > space) {
+		pumpResultStream();
+		space = (streamTail - streamHead - 1) & (STREAM_BUFFER_SIZE - 1);
+	}
+	if (len > space) {
+		streamDropped++;
+		return false;
+	}
+	for (uint8_t i = 0; i < len; i++) {
+		streamBuffer[streamHead] = frame[i];
+		streamHead = (streamHead + 1) & (STREAM_BUFFER_SIZE - 1);
+	}
+	return true;
+}
+
+
+// Initializes the UART (8N1, STREAM_BAUDRATE) without interrupts.
+void setupResultStream() {
+	UCSR0A = (1 << U2X0);
+	UBRR0 = (F_CPU / (8 * STREAM_BAUDRATE)) - 1;
+	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+	UCSR0B = (1 << TXEN0);
+	streamHead = 0;
+	streamTail = 0;
+}
+
+
+// Sends the start of a run.
+// @param mode The measurement mode, e.g. STREAM_MODE_PHOTO.
+void streamRunStart(uint8_t mode) {
+	struct StreamRunStart record;
+	record.type = STREAM_RECORD_RUN_START;
+	record.mode = mode;
+	record.version = STREAM_PROTOCOL_VERSION;
+	record.ticksPerUs = TIMEBASE_TICKS_PER_US;
+	record.framePeriodNs = (uint32_t)(getFramePeriod() * 1000.0 + 0.5);
+	streamDropped = 0;
+	writeRecord(&record, sizeof(record));
+}
+
+
+// Sends the result of one cycle. Must not be called inside a timed window.
+// @param mode The measurement mode, e.g. STREAM_MODE_PHOTO.
+// @param cycle The index of the cycle, starting at 1.
+// @param ticks The measured lag in timebase ticks.
+// @param threshold The threshold of the input.
+// @param thresholdWait The threshold of the 2nd trigger (or 0).
+// @param positiveThreshold true if the input needs to get bigger than the threshold.
+// @param pressTime The button press time in ms (min press time test), otherwise 0.
+// @param waitTicks The lag until the 2nd trigger in timebase ticks (or 0).
+void streamCycle(uint8_t mode, uint32_t cycle, uint32_t ticks, int threshold, int thresholdWait, bool positiveThreshold, uint16_t pressTime, uint32_t waitTicks) {
+	struct StreamCycle record;
+	record.type = STREAM_RECORD_CYCLE;
+	record.mode = mode;
+	record.cycle = cycle;
+	record.ticks = ticks;
+	record.threshold = threshold;
+	record.thresholdWait = thresholdWait;
+	record.pressTime = pressTime;
+	record.flags = (positiveThreshold) ? STREAM_FLAG_POSITIVE_THRESHOLD : 0;
+	record.waitTicks = waitTicks;
+	writeRecord(&record, sizeof(record));
+}
+
+
+// Sends the crossings of one response time cycle.
+// @param mode The measurement mode, e.g. STREAM_MODE_RESPONSE.
+// @param cycle The index of the cycle, starting at 1.
+// @param pressTicks The 10/50/90% crossings since the button press.
+// @param releaseTicks The 10/50/90% crossings since the button release.
+void streamResponse(uint8_t mode, uint32_t cycle, const uint32_t pressTicks[STREAM_RESPONSE_CROSSINGS], const uint32_t releaseTicks[STREAM_RESPONSE_CROSSINGS]) {
+	struct StreamResponse record;
+	record.type = STREAM_RECORD_RESPONSE;
+	record.mode = mode;
+	record.cycle = cycle;
+	for (uint8_t i = 0; i < STREAM_RESPONSE_CROSSINGS; i++) {
+		record.pressTicks[i] = pressTicks[i];
+		record.releaseTicks[i] = releaseTicks[i];
+	}
+	writeRecord(&record, sizeof(record));
+}
+
+
+// Sends the end of a run together with the sampling statistics
+// (see resetSamplingStats()).
+// @param mode The measurement mode, e.g. STREAM_MODE_PHOTO.
+// @param count The number of cycles.
+void streamRunEnd(uint8_t mode, uint32_t count) {
+	struct StreamRunEnd record;
+	record.type = STREAM_RECORD_RUN_END;
+	record.mode = mode;
+	record.count = count;
+	record.dropped = streamDropped;
+	const struct SamplingStats& stats = getSamplingStats();
+	record.sampleCycles = stats.cycles;
+	record.samples = stats.samples;
+	record.minInterval = stats.minInterval;
+	record.meanInterval = (stats.intervals > 0) ? stats.sumInterval / stats.intervals : 0;
+	record.maxInterval = stats.maxInterval;
+	writeRecord(&record, sizeof(record));
+}
+
+
+// Moves bytes from the ring buffer to the UART as long as the UART
+// accepts them. Does not wait.
+void pumpResultStream() {
+	while (streamTail != streamHead && (UCSR0A & (1 << UDRE0))) {
+		UDR0 = streamBuffer[streamTail];
+		streamTail = (streamTail + 1) & (STREAM_BUFFER_SIZE - 1);
+	}
+}
+
+
+// Sends a record. Waits (and transmits) until there is enough space
+// in the buffer, i.e. the record is never dropped.
+// Used for bulk data like waveforms. Must not be called inside a timed window.
+// @param record Pointer to the record.
+// @param size The size of the record. Max. STREAM_MAX_RECORD_SIZE.
+void streamRecordWait(const void* record, uint8_t size) {
+	writeRecord(record, size, true);
+}
+
+
+#else
+
+// Result stream disabled.
+void setupResultStream() {}
+void streamRunStart(uint8_t mode) {}
+void streamCycle(uint8_t mode, uint32_t cycle, uint32_t ticks, int threshold, int thresholdWait, bool positiveThreshold, uint16_t pressTime, uint32_t waitTicks) {}
+void streamResponse(uint8_t mode, uint32_t cycle, const uint32_t pressTicks[STREAM_RESPONSE_CROSSINGS], const uint32_t releaseTicks[STREAM_RESPONSE_CROSSINGS]) {}
+void streamRunEnd(uint8_t mode, uint32_t count) {}
+void pumpResultStream() {}
+void streamRecordWait(const void* record, uint8_t size) {}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __ResultStream_H__
+#define __ResultStream_H__
+
+#include <Arduino.h>
+#include "StreamProtocol.h"
+
+
+// Streams the result of each measurement cycle in binary form over the
+// serial port (see StreamProtocol.h). Enable with RESULT_STREAM_ENABLED
+// in Common.h. Otherwise all functions do nothing.
+// The UART is used without interrupts: the frames are written to a ring
+// buffer and pumpResultStream() moves them to the UART. pumpResultStream()
+// is called only from the waits between the measurements (e.g. waitMs()),
+// i.e. the transmission never disturbs a timed window.
+// If the buffer is full a record is dropped (and counted).
+
+
+void setupResultStream();
+void streamRunStart(uint8_t mode);
+void streamCycle(uint8_t mode, uint32_t cycle, uint32_t ticks, int threshold, int thresholdWait, bool positiveThreshold, uint16_t pressTime = 0, uint32_t waitTicks = 0);
+void streamResponse(uint8_t mode, uint32_t cycle, const uint32_t pressTicks[STREAM_RESPONSE_CROSSINGS], const uint32_t releaseTicks[STREAM_RESPONSE_CROSSINGS]);
+void streamRunEnd(uint8_t mode, uint32_t count);
+void pumpResultStream();
+void streamRecordWait(const void* record, uint8_t size);
+
+#endif
@@ -0,0 +1,226 @@
+#include "Sampler.h"
+#include "Timebase.h"
+
+
+// Size of the sample ring buffer. Must be a power of 2.
+// 32 samples are 0.83ms: if the measurement loop falls behind by more than
+// that the samples are lost and an overrun is reported.
+#define SAMPLE_BUFFER_SIZE  32
+
+// The ADC channel used for the keypad.
+#define KEYPAD_CHANNEL  0
+
+
+// The ring buffer filled by the ADC interrupt.
+static volatile struct Sample sampleBuffer[SAMPLE_BUFFER_SIZE];
+static volatile uint8_t sampleHead;
+static volatile uint8_t sampleTail;
+static volatile bool sampleOverrun;
+
+// The channels that should be sampled. Both are the same for a single input.
+static volatile uint8_t sampleChannels[2];
+// Index into sampleChannels of the next channel.
+static volatile uint8_t sampleChannelIndex;
+// The channel of the conversion that is currently running.
+static volatile uint8_t convChannel;
+// The channel that has been programmed for the conversion after the running one.
+static volatile uint8_t nextChannel;
+// Counts the conversions until the keypad is read again.
+static volatile uint8_t keypadCounter;
+// The last keypad value.
+static volatile int keypadValue;
+// true while sampling is active.
+static bool sampling = false;
+
+// Statistics of the samples.
+static struct SamplingStats stats;
+// Time of the last sample of the 1rst input, 0 = none.
+static uint32_t lastSampleTime;
+
+// Interrupts of timer 0 (millis) are switched off during sampling.
+static uint8_t savedTimsk0;
+
+
+// Called at the end of each conversion.
+// Note: in free-running mode the next conversion has already been started
+// when the interrupt is called. A change of ADMUX is therefore
+// effective only for the conversion after the next.
+ISR(ADC_vect) {
+	// Latch the time first
+	uint32_t time = extendTimebase(TCNT1);
+	int16_t value = ADC;
+	uint8_t channel = convChannel;
+	convChannel = nextChannel;
+
+	// Choose the channel for the conversion after the running one.
+	// Every 256th conversion is used for the keypad, the others
+	// alternate between the sampled channels.
+	keypadCounter++;
+	if (keypadCounter == 0) {
+		nextChannel = KEYPAD_CHANNEL;
+	}
+	else {
+		nextChannel = sampleChannels[sampleChannelIndex];
+		sampleChannelIndex ^= 1;
+	}
+	ADMUX = (ADMUX & 0xF0) | nextChannel;
+
+	// Keypad value
+	if (channel == KEYPAD_CHANNEL) {
+		keypadValue = value;
+		return;
+	}
+
+	// Store sample
+	uint8_t head = sampleHead;
+	uint8_t next = (head + 1) & (SAMPLE_BUFFER_SIZE - 1);
+	if (next == sampleTail) {
+		// Buffer full: sample is lost
+		sampleOverrun = true;
+		return;
+	}
+	sampleBuffer[head].time = time;
+	sampleBuffer[head].value = value;
+	sampleBuffer[head].channel = channel;
+	sampleHead = next;
+}
+
+
+// Starts the free running sampling of the given analog input(s).
+// Interrupts of timer 0 (millis) are disabled until stopSampling()
+// so that the conversion complete interrupt is not delayed.
+// @param inputPin The analog input to sample. Photo sensor or SVGA.
+// @param inputPin2 (Optional) If given: a 2nd analog input that is sampled
+// interleaved with inputPin. Use Sample::channel to distinguish them.
+void startSampling(int inputPin, int inputPin2) {
+	// Stop a previous sampling
+	ADCSRA &= ~((1 << ADATE) | (1 << ADIE));
+	while (ADCSRA & (1 << ADSC));
+
+	// Reset buffer
+	sampleHead = 0;
+	sampleTail = 0;
+	sampleOverrun = false;
+	keypadValue = 1023;
+	keypadCounter = 0;
+	lastSampleTime = 0;
+	stats.cycles++;
+
+	// Select channel(s). The first 2 conversions use inputPin (ADMUX),
+	// afterwards the ISR alternates between inputPin and inputPin2.
+	if (inputPin2 < 0)
+		inputPin2 = inputPin;
+	sampleChannels[0] = inputPin;
+	sampleChannels[1] = inputPin2;
+	sampleChannelIndex = 0;
+	convChannel = inputPin;
+	nextChannel = inputPin;
+	ADMUX = (ADMUX & 0xF0) | inputPin;
+
+	// Disable millis interrupt
+	if (!sampling)
+		savedTimsk0 = TIMSK0;
+	TIMSK0 = 0;
+	sampling = true;
+
+	// Free running mode
+	ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0));
+	ADCSRA |= (1 << ADIF);  // Clear pending bit
+	ADCSRA |= (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADSC);
+}
+
+
+// Stops the sampling and waits until the last conversion is done.
+// Afterwards analogRead() can be used again.
+// Does nothing if sampling is not active.
+void stopSampling() {
+	if (!sampling)
+		return;
+	ADCSRA &= ~((1 << ADATE) | (1 << ADIE));
+	while (ADCSRA & (1 << ADSC));
+	ADCSRA |= (1 << ADIF);  // Clear pending bit
+
+	// Enable millis interrupt again
+	TIMSK0 = savedTimsk0;
+	sampling = false;
+}
+
+
+// Returns the next sample from the buffer.
+// @param sample The sample is returned here.
+// @return false if no sample is available.
+bool getSample(struct Sample& sample) {
+	uint8_t tail = sampleTail;
+	if (tail == sampleHead)
+		return false;
+	sample.time = sampleBuffer[tail].time;
+	sample.value = sampleBuffer[tail].value;
+	sample.channel = sampleBuffer[tail].channel;
+	sampleTail = (tail + 1) & (SAMPLE_BUFFER_SIZE - 1);
+
+	// Statistics of the 1rst input
+	if (sample.channel == sampleChannels[0]) {
+		stats.samples++;
+		if (lastSampleTime != 0) {
+			uint32_t interval = sample.time - lastSampleTime;
+			if (interval > 0xFFFF)
+				interval = 0xFFFF;
+			if (interval < stats.minInterval)
+				stats.minInterval = interval;
+			if (interval > stats.maxInterval)
+				stats.maxInterval = interval;
+			stats.sumInterval += interval;
+			stats.intervals++;
+		}
+		lastSampleTime = sample.time;
+	}
+	return true;
+}
+
+
+// Resets the sampling statistics, e.g. at the start of a run.
+void resetSamplingStats() {
+	memset(&stats, 0, sizeof(stats));
+	stats.minInterval = 0xFFFF;
+}
+
+
+// Returns the sampling statistics since resetSamplingStats().
+const struct SamplingStats& getSamplingStats() {
+	return stats;
+}
+
+
+// Returns true if samples have been lost since startSampling().
+bool isSamplingOverrun() {
+	return sampleOverrun;
+}
+
+
+// Returns the last value read from the keypad (A0) during sampling.
+int getSampledKeypad() {
+	noInterrupts();
+	int value = keypadValue;
+	interrupts();
+	return value;
+}
+
+
+// Returns the time at which the input crossed the threshold, linearly
+// interpolated between 2 samples of the same channel.
+// This improves the resolution to a fraction of the sample interval.
+// @param prev The last sample before the crossing. If it is not valid
+// (channel SAMPLE_CHANNEL_NONE: no previous sample) the time of curr is returned.
+// @param curr The first sample after the crossing.
+// @param threshold The threshold between both values.
+// @return The crossing time in timebase ticks.
+uint32_t interpolateCrossing(const struct Sample& prev, const struct Sample& curr, int threshold) {
+	int diff = curr.value - prev.value;
+	if (prev.channel != curr.channel || diff == 0)
+		return curr.time;
+	uint32_t interval = curr.time - prev.time;
+	uint32_t offset = (uint32_t)((long)(threshold - prev.value) * (long)interval / diff);
+	if (offset > interval)
+		return curr.time;
+	return prev.time + offset;
+}
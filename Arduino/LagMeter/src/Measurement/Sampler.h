@@ -0,0 +1,50 @@
+#ifndef __Sampler_H__
+#define __Sampler_H__
+
+#include <Arduino.h>
+
+
+// The ADC is run in free-running mode with an ADC clock of F_CPU/32
+// (see SET_ADC_CLOCK in setup()). A conversion takes 13 ADC clocks, i.e.
+// a new sample is available every 26us (38.5kHz at 16MHz).
+// Every 256th conversion is used to read the keypad (A0) so that the
+// measurement loops don't need to call analogRead(0) themselves.
+// With 2 inputs the conversions alternate between both channels, i.e. each
+// channel is sampled every 52us.
+
+
+// One ADC conversion result together with the time latched
+// at conversion complete.
+struct Sample {
+	uint32_t time;	// Timebase ticks when the conversion completed
+	int16_t value;	// The 10 bit ADC value
+	uint8_t channel;	// The analog input of the conversion
+};
+
+// Channel of an invalid sample, e.g. "no previous sample" before the
+// first sample of a window.
+#define SAMPLE_CHANNEL_NONE  0xFF
+
+
+// Statistics of the samples of the 1rst input since resetSamplingStats().
+// Shows the real resolution of the measurements.
+struct SamplingStats {
+	uint32_t samples;	// Number of samples
+	uint16_t cycles;	// Number of startSampling() calls
+	uint16_t minInterval;	// Min. time between 2 samples (in timebase ticks)
+	uint16_t maxInterval;	// Max. time between 2 samples (in timebase ticks)
+	uint32_t sumInterval;	// Sum of the times between 2 samples (in timebase ticks)
+	uint32_t intervals;	// Number of intervals
+};
+
+
+void startSampling(int inputPin, int inputPin2 = -1);
+void stopSampling();
+bool getSample(struct Sample& sample);
+bool isSamplingOverrun();
+int getSampledKeypad();
+void resetSamplingStats();
+const struct SamplingStats& getSamplingStats();
+uint32_t interpolateCrossing(const struct Sample& prev, const struct Sample& curr, int threshold);
+
+#endif
@@ -0,0 +1,63 @@
+#include "Scheduler.h"
+
+
+// A registered task.
+struct Task {
+	TaskFunction function;
+	uint16_t interval;	// in ms, 0 = on each runTasks()
+	unsigned long lastRun;	// millis() of the last call
+	bool suspendable;	// false: runs also while the tasks are suspended
+};
+
+static struct Task tasks[SCHEDULER_MAX_TASKS];
+static uint8_t taskCount;
+// true while runTasks() is executed.
+static bool tasksRunning;
+// true while the tasks are suspended.
+static bool tasksSuspended;
+
+
+// Registers a task.
+// @param task The function to call.
+// @param intervalMs The task is called every intervalMs (in ms), 0 = as often as possible.
+// @param suspendable false if the task keeps running while the tasks are suspended.
+// @return false if there are already SCHEDULER_MAX_TASKS tasks.
+bool addTask(TaskFunction task, uint16_t intervalMs, bool suspendable) {
+	if (taskCount >= SCHEDULER_MAX_TASKS)
+		return false;
+	tasks[taskCount].function = task;
+	tasks[taskCount].interval = intervalMs;
+	tasks[taskCount].lastRun = millis();
+	tasks[taskCount].suspendable = suspendable;
+	taskCount++;
+	return true;
+}
+
+
+// Calls all tasks that are due. While the tasks are suspended only
+// the tasks that are not suspendable are called.
+void runTasks() {
+	if (tasksRunning)
+		return;
+	tasksRunning = true;
+	unsigned long now = millis();
+	for (uint8_t i = 0; i < taskCount; i++) {
+		struct Task& task = tasks[i];
+		if (tasksSuspended && task.suspendable)
+			continue;
+		if (task.interval != 0) {
+			if (now - task.lastRun < task.interval)
+				continue;
+			task.lastRun = now;
+		}
+		task.function();
+	}
+	tasksRunning = false;
+}
+
+
+// Suspends or resumes the execution of the (suspendable) tasks.
+// @param suspend true to suspend, false to resume.
+void suspendTasks(bool suspend) {
+	tasksSuspended = suspend;
+}
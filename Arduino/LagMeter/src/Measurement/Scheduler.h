@@ -0,0 +1,31 @@
+#ifndef __Scheduler_H__
+#define __Scheduler_H__
+
+#include <Arduino.h>
+
+
+// Cooperative scheduler for the background tasks (keypad scanner,
+// result stream, USB, ...).
+// runTasks() is called from the main loop and from all waits
+// (waitMs(), selectMenu(), ...), so the tasks keep running while
+// a test waits for the user or for the system under test.
+// Timed windows that call waits or getLcdKey() (e.g. the USB lag) suspend
+// the tasks. Only the tasks registered as not suspendable (the keypad
+// scanner) keep running, so that the window can still be aborted.
+// Such a task does run inside the window (the keypad scanner takes about
+// 100us for the ADC conversion), so a window needs to latch its time
+// before it calls waits, getLcdKey() or isAbort().
+// A task must not block. runTasks() is not reentrant: it does nothing
+// if it is called from inside a task.
+
+// Max. number of tasks.
+#define SCHEDULER_MAX_TASKS  8
+
+typedef void (*TaskFunction)();
+
+
+bool addTask(TaskFunction task, uint16_t intervalMs, bool suspendable = true);
+void runTasks();
+void suspendTasks(bool suspend);
+
+#endif
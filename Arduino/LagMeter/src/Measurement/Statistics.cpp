@@ -0,0 +1,65 @@
+#include "Statistics.h"
+
+
+// Constructor.
+Statistics::Statistics() {
+	clear();
+}
+
+
+// Removes all values.
+void Statistics::clear() {
+	count = 0;
+	mean = 0.0;
+	m2 = 0.0;
+	minValue = 0;
+	maxValue = 0;
+}
+
+
+// Adds a value (Welford's algorithm).
+void Statistics::add(long value) {
+	if (count == 0) {
+		minValue = value;
+		maxValue = value;
+	}
+	else {
+		if (value < minValue)
+			minValue = value;
+		if (value > maxValue)
+			maxValue = value;
+	}
+	count++;
+	double delta = value - mean;
+	mean += delta / count;
+	m2 += delta * (value - mean);
+}
+
+
+// Returns the (sample) standard deviation.
+double Statistics::getStdDev() const {
+	if (count < 2)
+		return 0.0;
+	return sqrt(m2 / (count - 1));
+}
+
+
+// Returns the half width of the 95% confidence interval of the mean.
+// The t-quantile is approximated by z + (z^3 + z) / (4 * df) with z = 1.96.
+// This is good enough for df >= 5.
+double Statistics::getConfidenceHalfWidth() const {
+	if (count < 2)
+		return INFINITY;
+	uint16_t df = count - 1;
+	double t = 1.96 + 2.37 / df;
+	return t * getStdDev() / sqrt(count);
+}
+
+
+// Returns true if at least minCount values have been added and
+// the 95% confidence interval of the mean is smaller than 'width'.
+bool Statistics::isConverged(uint16_t minCount, double width) const {
+	if (count < minCount)
+		return false;
+	return 2.0 * getConfidenceHalfWidth() < width;
+}
@@ -0,0 +1,54 @@
+#ifndef __Statistics_H__
+#define __Statistics_H__
+
+#include <Arduino.h>
+
+
+// Online statistics of a run: mean and variance (Welford) and min/max.
+// Used to stop a run as soon as the mean is known precisely enough.
+class Statistics {
+public:
+	Statistics();
+
+	// Removes all values.
+	void clear();
+
+	// Adds a value.
+	void add(long value);
+
+	// Returns the number of values.
+	uint16_t getCount() const {
+		return count;
+	}
+
+	long getMin() const {
+		return minValue;
+	}
+
+	long getMax() const {
+		return maxValue;
+	}
+
+	double getMean() const {
+		return mean;
+	}
+
+	// Returns the (sample) standard deviation.
+	double getStdDev() const;
+
+	// Returns the half width of the 95% confidence interval of the mean.
+	double getConfidenceHalfWidth() const;
+
+	// Returns true if at least minCount values have been added and
+	// the 95% confidence interval of the mean is smaller than 'width'.
+	bool isConverged(uint16_t minCount, double width) const;
+
+protected:
+	uint16_t count;
+	double mean;
+	double m2;	// Sum of squared differences from the mean
+	long minValue;
+	long maxValue;
+};
+
+#endif
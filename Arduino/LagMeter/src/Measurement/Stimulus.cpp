@@ -0,0 +1,52 @@
+#include "Stimulus.h"
+#include "Common.h"
+
+
+// The fractional part of the golden ratio (0.6180339887) as 16 bit fraction.
+#define GOLDEN_RATIO_FRACTION  40503u
+
+
+// The period of the system under test (in us), 0 = not known.
+static unsigned long stimulusPeriod = 0;
+// The current phase as 16 bit fraction of the period.
+static uint16_t stimulusPhase;
+
+
+// Sets the period of the system under test, e.g. the frame period.
+// @param periodUs The period in us.
+void setStimulusPeriod(unsigned long periodUs) {
+	stimulusPeriod = periodUs;
+}
+
+
+// Returns the period used for the schedule (in us), 0 if not known.
+unsigned long getStimulusPeriod() {
+	return stimulusPeriod;
+}
+
+
+// Starts a new schedule. The sequence starts at a random phase
+// so that different runs use different phases.
+void startStimulusSchedule() {
+	stimulusPhase = random(0x10000l);
+}
+
+
+// Returns the delay for the next press (in us).
+// I.e. STIMULUS_BASE_WAIT plus the next phase offset.
+// @param periodUs The period to use, 0 if not known (random offset).
+unsigned long getNextStimulusDelay(unsigned long periodUs) {
+	if (periodUs == 0)
+		return STIMULUS_BASE_WAIT * 1000l + random(STIMULUS_RANDOM_RANGE_US) + random(STIMULUS_RANDOM_RANGE_US);
+	stimulusPhase += GOLDEN_RATIO_FRACTION;
+	// 12 bit of the phase are enough (and avoid an overflow for periods up to 1s)
+	unsigned long offset = ((uint32_t)(stimulusPhase >> 4) * periodUs) >> 12;
+	return STIMULUS_BASE_WAIT * 1000l + offset;
+}
+
+
+// Returns the delay for the next press (in us) for the
+// period set with setStimulusPeriod().
+unsigned long getNextStimulusDelay() {
+	return getNextStimulusDelay(stimulusPeriod);
+}
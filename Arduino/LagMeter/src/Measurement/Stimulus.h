@@ -0,0 +1,28 @@
+#ifndef __Stimulus_H__
+#define __Stimulus_H__
+
+#include <Arduino.h>
+
+
+// Schedules the button presses so that the phase relative to the frame
+// (or poll) period of the system is covered uniformly.
+// The delay between the previous reaction (which is locked to the frame)
+// and the next press is STIMULUS_BASE_WAIT plus a phase offset.
+// If the period is known (e.g. measured with "Refresh" or the USB poll
+// interval) the phase offsets follow the golden ratio sequence
+// (frac(k * 0.618...)), a low-discrepancy sequence: every n consecutive
+// offsets are spread evenly over the period. This needs the real period:
+// with a wrong period a part of the real period is covered more often.
+// If the period is not known the offsets are random (the sum of 2 uniform
+// random values, see STIMULUS_RANDOM_RANGE_US). The phase is then not
+// exactly uniform, but the deviation is small for any period up to
+// 2*STIMULUS_RANDOM_RANGE_US (a few % for 60Hz).
+
+
+void setStimulusPeriod(unsigned long periodUs);
+unsigned long getStimulusPeriod();
+void startStimulusSchedule();
+unsigned long getNextStimulusDelay();
+unsigned long getNextStimulusDelay(unsigned long periodUs);
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef __StreamProtocol_H__
+#define __StreamProtocol_H__
+
+#include <stdint.h>
+
+
+// Binary result stream of the LagMeter.
+// This file is shared with the host tool (Test/LagStream), so it must
+// not depend on Arduino headers.
+//
+// Each record is sent as one frame:
+//   COBS(record + CRC16) + 0x00
+// The CRC16 (CCITT, poly 0x1021, init 0xFFFF) is calculated over the record
+// and appended little endian. COBS encoding removes all zeros from the frame
+// so that 0x00 can be used as frame delimiter.
+// All values are little endian (AVR and x86).
+
+// Version of the protocol. Increased on incompatible changes.
+#define STREAM_PROTOCOL_VERSION  5
+
+// Baudrate of the stream. Exact at 16MHz and a standard rate on the host.
+#define STREAM_BAUDRATE  500000l
+
+// Max. size of a record (without CRC).
+#define STREAM_MAX_RECORD_SIZE  32
+
+// Max. size of a frame: record + CRC + COBS overhead + delimiter.
+#define STREAM_MAX_FRAME_SIZE  (STREAM_MAX_RECORD_SIZE + 2 + 1 + 1)
+
+
+// Record types.
+enum {
+	STREAM_RECORD_RUN_START = 1,
+	STREAM_RECORD_CYCLE = 2,
+	STREAM_RECORD_RUN_END = 3,
+	STREAM_RECORD_WAVEFORM = 4,
+	STREAM_RECORD_WAVEFORM_DATA = 5,
+	STREAM_RECORD_RESPONSE = 6,
+};
+
+// Measurement modes.
+enum {
+	STREAM_MODE_PHOTO = 1,       // Button -> Photosensor
+	STREAM_MODE_SVGA = 2,        // Button -> AD2 (SVGA)
+	STREAM_MODE_MONITOR = 3,     // SVGA -> Photosensor
+	STREAM_MODE_MIN_PRESS = 4,   // Minimum button press time
+	STREAM_MODE_USB = 5,         // Button -> USB report
+	STREAM_MODE_RESPONSE = 6,    // Response time (10%, 50%, 90%)
+	STREAM_MODE_POLL_PERIOD = 7, // Poll period (press time sweep)
+};
+
+// Number of crossings (10%, 50%, 90%) of a response record.
+#define STREAM_RESPONSE_CROSSINGS  3
+
+// Number of samples in a waveform data record.
+#define STREAM_WAVEFORM_CHUNK  24
+
+// Flags of a cycle record.
+enum {
+	STREAM_FLAG_POSITIVE_THRESHOLD = 0x01,
+};
+
+
+// Sent at the start of a run.
+struct __attribute__((packed)) StreamRunStart {
+	uint8_t type;            // STREAM_RECORD_RUN_START
+	uint8_t mode;
+	uint8_t version;         // STREAM_PROTOCOL_VERSION
+	uint8_t ticksPerUs;      // Resolution of the ticks
+	uint32_t framePeriodNs;  // Detected frame period of the display in ns, 0 if not known
+};
+
+// Sent for each measurement cycle after the timed window.
+struct __attribute__((packed)) StreamCycle {
+	uint8_t type;            // STREAM_RECORD_CYCLE
+	uint8_t mode;
+	uint32_t cycle;          // Index of the cycle within the run, starting at 1
+	uint32_t ticks;          // The measured lag in timebase ticks (since the 2nd trigger if used)
+	int16_t threshold;       // ADC threshold of the input
+	int16_t thresholdWait;   // ADC threshold of the 2nd trigger (SVGA -> Photosensor)
+	uint16_t pressTime;      // Button press time in ms (min press time), 0 otherwise
+	uint8_t flags;
+	uint32_t waitTicks;      // Lag until the 2nd trigger (SVGA -> Photosensor: source lag), 0 otherwise
+};
+
+// Sent at the end of a run.
+struct __attribute__((packed)) StreamRunEnd {
+	uint8_t type;            // STREAM_RECORD_RUN_END
+	uint8_t mode;
+	uint32_t count;          // Number of cycles
+	uint16_t dropped;        // Number of records dropped because the buffer was full
+	uint16_t sampleCycles;   // Number of sampled timed windows
+	uint32_t samples;        // Number of samples of the input in all windows
+	uint16_t minInterval;    // Min. time between 2 samples (ticks), 0xFFFF if none
+	uint16_t meanInterval;   // Mean time between 2 samples (ticks)
+	uint16_t maxInterval;    // Max. time between 2 samples (ticks)
+};
+
+// Sent for each cycle of the response time measurement.
+struct __attribute__((packed)) StreamResponse {
+	uint8_t type;            // STREAM_RECORD_RESPONSE
+	uint8_t mode;            // STREAM_MODE_RESPONSE
+	uint32_t cycle;          // Index of the cycle within the run, starting at 1
+	uint32_t pressTicks[STREAM_RESPONSE_CROSSINGS];    // 10/50/90% crossings since button press
+	uint32_t releaseTicks[STREAM_RESPONSE_CROSSINGS];  // 10/50/90% crossings since button release
+};
+
+// Sent for each captured waveform. Followed by the data records.
+struct __attribute__((packed)) StreamWaveform {
+	uint8_t type;            // STREAM_RECORD_WAVEFORM
+	uint8_t mode;            // STREAM_MODE_PHOTO or STREAM_MODE_SVGA
+	uint32_t cycle;          // Index of the capture, starting at 1
+	uint32_t triggerTicks;   // Time of the threshold crossing since button press
+	uint32_t firstTicks;     // Time of the first sample since button press
+	uint16_t periodTicks;    // Time between 2 samples
+	uint16_t count;          // Number of samples
+	uint16_t triggerIndex;   // Index of the first sample after the crossing
+	int16_t threshold;       // ADC threshold
+	int16_t levelOn;         // Calibrated level while the button is pressed
+	int16_t levelOff;        // Calibrated level while the button is released
+	uint8_t flags;
+};
+
+// The samples of a waveform. The last record may contain less
+// than STREAM_WAVEFORM_CHUNK samples.
+struct __attribute__((packed)) StreamWaveformData {
+	uint8_t type;            // STREAM_RECORD_WAVEFORM_DATA
+	uint8_t mode;
+	uint16_t offset;         // Index of the first sample in this record
+	uint8_t samples[STREAM_WAVEFORM_CHUNK];   // ADC value / 4
+};
+
+
+// Updates the CRC16 (CCITT) with one byte.
+static inline uint16_t streamCrc16Update(uint16_t crc, uint8_t data) {
+	crc ^= (uint16_t)data << 8;
+	for (uint8_t i = 0; i < 8; i++) {
+		if (crc & 0x8000)
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+	return crc;
+}
+
+
+// Calculates the CRC16 (CCITT) of a buffer.
+static inline uint16_t streamCrc16(const uint8_t* data, uint8_t size) {
+	uint16_t crc = 0xFFFF;
+	while (size--)
+		crc = streamCrc16Update(crc, *data++);
+	return crc;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#include "Timebase.h"
+
+
+// The number of timer 1 overflows since the last reset, i.e. the upper 16 bits of the time.
+static volatile uint16_t timebaseOverflows;
+
+
+// Counts the overflows.
+ISR(TIMER1_OVF_vect) {
+	timebaseOverflows++;
+}
+
+
+// Sets up timer 1 as timebase and resets the time to 0.
+// Prescaler: 8 -> resolution 0.5us (at F_CPU=16MHz).
+void startTimebase() {
+	TCCR1A = 0; // No PWM
+	TCCR1B = (1 << CS11);  // Prescaler = 8
+	resetTimebase();
+	TIMSK1 = 1 << TOIE1;
+}
+
+
+// Resets the time to 0.
+void resetTimebase() {
+	uint8_t sreg = SREG;
+	noInterrupts();
+	TCNT1 = 0;
+	timebaseOverflows = 0;
+	TIFR1 = 1 << TOV1;  // Clear pending bits
+	SREG = sreg;
+}
+
+
+// Disables all timer 1 interrupts.
+void stopTimebase() {
+	TIMSK1 = 0;
+}
+
+
+// Returns the time in ticks since the last reset.
+uint32_t getTimebase() {
+	uint8_t sreg = SREG;
+	noInterrupts();
+	uint32_t time = extendTimebase(TCNT1);
+	SREG = sreg;
+	return time;
+}
+
+
+// Extends a timer 1 value to 32 bits.
+// Must be called with interrupts off (e.g. from an ISR) shortly after
+// TCNT1 (or ICR1) has been read.
+// @param tcnt The timer 1 value.
+// @return The time in ticks since the last reset.
+uint32_t extendTimebase(uint16_t tcnt) {
+	uint16_t overflows = timebaseOverflows;
+	// Check for an overflow that has not been counted yet
+	if ((TIFR1 & (1 << TOV1)) && tcnt < 0x8000)
+		overflows++;
+	return ((uint32_t)overflows << 16) | tcnt;
+}
+
+
+// Converts ticks into us (with rounding).
+long ticksToUs(uint32_t ticks) {
+	return (ticks + TIMEBASE_TICKS_PER_US / 2) / TIMEBASE_TICKS_PER_US;
+}
+
+
+// Converts us into ticks.
+uint32_t usToTicks(unsigned long us) {
+	return us * TIMEBASE_TICKS_PER_US;
+}
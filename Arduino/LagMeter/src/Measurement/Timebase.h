@@ -0,0 +1,24 @@
+#ifndef __Timebase_H__
+#define __Timebase_H__
+
+#include <Arduino.h>
+
+
+// Timer 1 is used as timebase for all lag measurements.
+// It runs with prescaler 8, i.e. one tick is 0.5us at 16MHz (1us at 8MHz).
+// The overflows (every 32.8ms at 16MHz) are counted in software to extend
+// the time to 32 bits (35 minutes at 16MHz).
+
+// Timebase ticks per us.
+#define TIMEBASE_TICKS_PER_US  (F_CPU / 8000000l)
+
+
+void startTimebase();
+void resetTimebase();
+void stopTimebase();
+uint32_t getTimebase();
+uint32_t extendTimebase(uint16_t tcnt);
+long ticksToUs(uint32_t ticks);
+uint32_t usToTicks(unsigned long us);
+
+#endif
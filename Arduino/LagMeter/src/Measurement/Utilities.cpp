@@ -1,4 +1,6 @@
 #include "Utilities.h"
+#include "Scheduler.h"
+#include "Common.h"
 #include "Arduino.h"
 
 // Is set if a function is (forcefully) left.
@@ -8,20 +10,38 @@ bool abortAll = true;
 
 
 // LCD pin configuration.
-LiquidCrystal lcd(19, 17, 18, 4, 5, 6, 7);
+#ifdef COMPARATOR_ENABLED
+// A3 (17) checks the comparator reference, i.e. RW of the LCD needs to be wired to GND.
+static LiquidCrystal lcdDisplay(19, 18, 4, 5, 6, 7);
+#else
+static LiquidCrystal lcdDisplay(19, 17, 18, 4, 5, 6, 7);
+#endif
+// All output goes to the shadow buffer (see LcdBuffer.h).
+LcdBuffer lcd(lcdDisplay);
 
 
 
-// Returns the pressed key (or LCD_KEY_NONE).
-int getLcdKey() {
-	int x = analogRead(0);
-	// Return immediately if nothing is pressed
-	if (x >= LCD_KEY_PRESS_THRESHOLD)
-		return LCD_KEY_NONE;
+// The keypad is scanned by a task (see Scheduler.h) every KEYPAD_SCAN_INTERVAL.
+// A key is accepted if it has been read unchanged for KEYPAD_DEBOUNCE_TIME.
+#define KEYPAD_SCAN_INTERVAL  5    // in ms
+#define KEYPAD_DEBOUNCE_TIME  30   // in ms
 
-	waitLcdKeyRelease();
+// waitUs() doesn't execute the tasks at the end of the wait (in us).
+#define WAIT_US_TASK_MARGIN  2000
 
-	// Return
+// The debounced key.
+static int keypadKey = LCD_KEY_NONE;
+// The last read key and since when it is read.
+static int keypadReadKey = LCD_KEY_NONE;
+static unsigned long keypadReadTime;
+// The key press that has not been fetched with getLcdKey() yet.
+static int keypadEvent = LCD_KEY_NONE;
+
+
+// Converts the analog value of the keypad into a key.
+static int analogToLcdKey(int x) {
+	if (x >= LCD_KEY_PRESS_THRESHOLD)
+		return LCD_KEY_NONE;
 	if (x < 60)
 		return LCD_KEY_RIGHT;
 	if (x < 200)
@@ -34,13 +54,84 @@ int getLcdKey() {
 }
 
 
+// Task: Reads and debounces the keypad.
+// A press of a key is stored as event for getLcdKey().
+static void scanKeypad() {
+	int key = analogToLcdKey(analogRead(0));
+	unsigned long now = millis();
+	if (key != keypadReadKey) {
+		keypadReadKey = key;
+		keypadReadTime = now;
+		return;
+	}
+	if (key == keypadKey || now - keypadReadTime < KEYPAD_DEBOUNCE_TIME)
+		return;
+	keypadKey = key;
+	if (key != LCD_KEY_NONE)
+		keypadEvent = key;
+}
+
+
+// Registers the keypad scanner task.
+// It keeps running while the tasks are suspended, i.e. a timed window
+// can be aborted with a key.
+void setupKeypad() {
+	if (!addTask(scanKeypad, KEYPAD_SCAN_INTERVAL, false))
+		Error(F("Error:"), F("Too many tasks"));
+}
+
+
+// Task: Writes the changes of the LCD buffer to the display.
+static void updateLcd() {
+	lcd.update();
+}
+
+
+// Initializes the LCD and registers the update task.
+void setupLcd() {
+	lcd.begin(LCD_COLS, LCD_ROWS);
+	if (!addTask(updateLcd, 0))
+		Error(F("Error:"), F("Too many tasks"));
+}
+
+
+// Returns the pressed key (or LCD_KEY_NONE).
+// Does not block: Each key press is returned once, as soon as it has
+// been debounced. The tasks are executed.
+int getLcdKey() {
+	runTasks();
+	int key = keypadEvent;
+	keypadEvent = LCD_KEY_NONE;
+	return key;
+}
+
+
+// Returns the pressed key (or LCD_KEY_NONE).
+// Like getLcdKey() but if a key is pressed that has not been debounced
+// yet, the debouncing is waited for. Used after a timed window in which
+// the scanner could not run.
+int readLcdKey() {
+	unsigned long startTime = millis();
+	int key;
+	do {
+		key = getLcdKey();
+	} while (key == LCD_KEY_NONE && analogRead(0) < LCD_KEY_PRESS_THRESHOLD
+		&& millis() - startTime < KEYPAD_DEBOUNCE_TIME + 2 * KEYPAD_SCAN_INTERVAL);
+	return key;
+}
+
+
 // Waits on release of key press.
+// The key press is discarded, i.e. it is not returned by getLcdKey().
+// The tasks are executed meanwhile.
 void waitLcdKeyRelease() {
-	// Some key has been pressed
-	delay(100);	// poor man's debounce
-	// Wait until released
-	while (analogRead(0) < LCD_KEY_PRESS_THRESHOLD);
-	delay(100); // debounce
+	// The key may not have been read by the scanner yet
+	scanKeypad();
+	// Wait until released (and debounced)
+	while (keypadKey != LCD_KEY_NONE || keypadReadKey != LCD_KEY_NONE
+		|| millis() - keypadReadTime < KEYPAD_DEBOUNCE_TIME)
+		runTasks();
+	keypadEvent = LCD_KEY_NONE;
 }
 
 
@@ -55,6 +146,7 @@ bool isAbort() {
 
 
 // Waits for a certain time or abort (keypress).
+// Meanwhile the tasks are executed (e.g. the result stream is transmitted).
 void waitMs(int waitTime) {
 	int time;
 	int startTime = millis();
@@ -66,6 +158,63 @@ void waitMs(int waitTime) {
 }
 
 
+// Waits for a certain time (in us) or abort (keypress).
+// More exact than waitMs(): The tasks are not executed during the
+// last WAIT_US_TASK_MARGIN, so the wait does not overrun.
+void waitUs(unsigned long waitTime) {
+	unsigned long startTime = micros();
+	unsigned long time;
+	while ((time = micros() - startTime) < waitTime) {
+		if (waitTime - time > WAIT_US_TASK_MARGIN && isAbort())
+			return;
+	}
+}
+
+
+// Shows a menu and lets the user choose an entry.
+// The chosen entry is shown in the 1rst line, the next entry in the 2nd line.
+// UP/DOWN scroll, SELECT or RIGHT choose the entry, LEFT leaves the menu.
+// @param entries The menu entries.
+// @param count The number of entries.
+// @return The index of the chosen entry or -1 if the menu was left.
+int selectMenu(const __FlashStringHelper* const entries[], int count) {
+	int index = 0;
+	while (true) {
+		// Print
+		lcd.clear();
+		lcd.print(F(">"));
+		lcd.print(entries[index]);
+		if (index + 1 < count) {
+			lcd.setCursor(0, 1);
+			lcd.print(F(" "));
+			lcd.print(entries[index + 1]);
+		}
+
+		// Wait on key
+		int key;
+		do {
+			key = getLcdKey();
+		} while (key == LCD_KEY_NONE);
+
+		switch (key) {
+		case LCD_KEY_UP:
+			if (index > 0)
+				index--;
+			break;
+		case LCD_KEY_DOWN:
+			if (index + 1 < count)
+				index++;
+			break;
+		case LCD_KEY_LEFT:
+			abortAll = true;
+			return -1;
+		default:
+			return index;
+		}
+	}
+}
+
+
 // Called if an error occurs.
 // Prints error and waits on a key press.
 // Then aborts.
@@ -158,4 +307,21 @@ char* longToString(unsigned long value) {
 		strcpy(vs, ">99M");
 	}
 	return vs;
-}
\ No newline at end of file
+}
+
+// Converts a time in us into a string in ms with 1 decimal (with rounding).
+// The returned string is statically allocated, i.e. it is overwritten
+// when the function is used the 2nd time.
+// @param time The time to convert in us.
+// @return A string, e.g. "12.3" or "-0.2"
+char* usToMsString(long time) {
+	static char ts[8 + 1];
+	const char* sign = "";
+	if (time < 0) {
+		sign = "-";
+		time = -time;
+	}
+	long tenths = (time + 50l) / 100l;
+	snprintf(ts, sizeof(ts), "%s%ld.%ld", sign, tenths / 10l, tenths % 10l);
+	return ts;
+}
@@ -1,7 +1,7 @@
 #ifndef __Utilities_H__
 #define __Utilities_H__
 
-#include <LiquidCrystal.h>
+#include "LcdBuffer.h"
 
 
 
@@ -24,14 +24,20 @@ enum {
 
 
 extern bool abortAll;
-extern LiquidCrystal lcd;
+extern LcdBuffer lcd;
 
+void setupKeypad();
+void setupLcd();
 int getLcdKey();
+int readLcdKey();
 void waitLcdKeyRelease();
 bool isAbort();
 void waitMs(int waitTime);
+void waitUs(unsigned long waitTime);
+int selectMenu(const __FlashStringHelper* const entries[], int count);
 void Error(const __FlashStringHelper* area, const __FlashStringHelper* error);
 char* secsToString(unsigned long time);
 char* longToString(unsigned long value);
+char* usToMsString(long time);
 
 #endif
@@ -0,0 +1,229 @@
+#include "Waveform.h"
+#include "Utilities.h"
+#include "Common.h"
+#include "Measure.h"
+#include "Sampler.h"
+#include "Timebase.h"
+#include "Button.h"
+#include "ResultStream.h"
+
+
+// The trace (ring buffer).
+static uint8_t trace[WAVEFORM_SAMPLES];
+
+
+// Information about a captured trace.
+struct WaveformCapture {
+	uint32_t triggerTime;	// Time of the crossing
+	uint32_t firstTime;	// Time of the first sample
+	uint16_t first;	// Number of the first sample, i.e. trace[first % WAVEFORM_SAMPLES]
+	uint16_t count;	// Number of samples
+	uint16_t triggerIndex;	// Index of the first sample after the crossing
+};
+
+
+// Presses the button and captures the trace of the input until
+// WAVEFORM_SAMPLES - WAVEFORM_PRE_TRIGGER samples after the crossing are stored.
+// @param inputPin Pin from which the analog input is read. Photo sensor or SVGA.
+// @param threshold The value to compare the inputPin value to.
+// @param positiveThreshold If true check that inputPin value is bigger, if false check that inputPin value is smaller.
+// @param capture The times and indices of the trace are returned here.
+// @return false on error or abort.
+static bool captureWaveform(int inputPin, int threshold, bool positiveThreshold, struct WaveformCapture& capture) {
+	struct Sample sample;
+	const uint32_t timeout = usToTicks(MEASURE_TIMEOUT * 1000l);
+	const uint16_t period = usToTicks(WAVEFORM_PERIOD_US);
+	uint32_t nextStoreTime = 0;
+	uint16_t stored = 0;
+	uint16_t triggerStored = 0;
+	bool triggered = false;
+	bool accuracyOvrflw = false;
+	bool counterOvrflw = false;
+	bool keyPressed = false;
+
+	startTimebase();
+
+	// Simulate joystick button and reset timer
+	resetTimebaseWithButton(true);
+
+	startSampling(inputPin);
+	while (true) {
+		if (getSample(sample)) {
+			// Store a sample every period. The sample times are not exactly
+			// equidistant: the error is less than one ADC sample (26us).
+			while ((int32_t)(sample.time - nextStoreTime) >= 0) {
+				trace[stored & (WAVEFORM_SAMPLES - 1)] = sample.value >> 2;
+				stored++;
+				nextStoreTime += period;
+			}
+
+			if (triggered) {
+				// Check if all samples after the crossing are stored
+				if (stored - triggerStored >= WAVEFORM_SAMPLES - WAVEFORM_PRE_TRIGGER)
+					break;
+				continue;
+			}
+
+			// Check for threshold
+			if ((positiveThreshold && sample.value > threshold) // Check if value is bigger
+				|| (!positiveThreshold && sample.value < threshold)) // Check if value is smaller
+			{
+				capture.triggerTime = sample.time;
+				triggerStored = stored;
+				triggered = true;
+				continue;
+			}
+
+			// Check for time out
+			if (sample.time > timeout) {
+				counterOvrflw = true;
+				break;
+			}
+			continue;
+		}
+
+		// Assure that no samples were lost
+		if (isSamplingOverrun()) {
+			accuracyOvrflw = true;
+			break;
+		}
+
+		// Check if key pressed
+		if (getSampledKeypad() < LCD_KEY_PRESS_THRESHOLD) {
+			keyPressed = true;
+			break;
+		}
+	}
+
+	stopSampling();
+	stopTimebase();
+
+	if (keyPressed) {
+		waitLcdKeyRelease();
+		abortAll = true;
+		return false;
+	}
+	if (accuracyOvrflw) {
+		Error(F("Error:"), F(CHECK_ACCURACY_ERROR_STR));
+		return false;
+	}
+	if (counterOvrflw) {
+		Error(F("Error:"), F("No signal"));
+		return false;
+	}
+
+	// The trace contains the last WAVEFORM_SAMPLES samples
+	capture.count = (stored < WAVEFORM_SAMPLES) ? stored : WAVEFORM_SAMPLES;
+	capture.first = stored - capture.count;
+	capture.firstTime = (uint32_t)capture.first * period;
+	capture.triggerIndex = triggerStored - capture.first;
+	return true;
+}
+
+
+// Streams the captured trace.
+// @param mode STREAM_MODE_PHOTO or STREAM_MODE_SVGA.
+// @param cycle The index of the capture.
+// @param calib The calibration of the input.
+// @param capture The capture information.
+static void streamWaveform(uint8_t mode, uint32_t cycle, const struct Calibration& calib, const struct WaveformCapture& capture) {
+	struct StreamWaveform header;
+	header.type = STREAM_RECORD_WAVEFORM;
+	header.mode = mode;
+	header.cycle = cycle;
+	header.triggerTicks = capture.triggerTime;
+	header.firstTicks = capture.firstTime;
+	header.periodTicks = usToTicks(WAVEFORM_PERIOD_US);
+	header.count = capture.count;
+	header.triggerIndex = capture.triggerIndex;
+	header.threshold = calib.threshold;
+	header.levelOn = calib.levelOn;
+	header.levelOff = calib.levelOff;
+	header.flags = (calib.positiveThreshold) ? STREAM_FLAG_POSITIVE_THRESHOLD : 0;
+	streamRecordWait(&header, sizeof(header));
+
+	struct StreamWaveformData data;
+	data.type = STREAM_RECORD_WAVEFORM_DATA;
+	data.mode = mode;
+	for (uint16_t offset = 0; offset < capture.count; offset += STREAM_WAVEFORM_CHUNK) {
+		uint16_t remaining = capture.count - offset;
+		uint8_t n = (remaining < STREAM_WAVEFORM_CHUNK) ? remaining : STREAM_WAVEFORM_CHUNK;
+		data.offset = offset;
+		for (uint8_t i = 0; i < n; i++)
+			data.samples[i] = trace[(capture.first + offset + i) & (WAVEFORM_SAMPLES - 1)];
+		streamRecordWait(&data, sizeof(data) - STREAM_WAVEFORM_CHUNK + n);
+	}
+}
+
+
+// Calibrates the input and afterwards captures the trace
+// of the input for each button press until a key is pressed.
+// The traces are streamed over the serial port (RESULT_STREAM_ENABLED).
+// The LCD shows the lag of the last capture.
+// @param inputPin The input to capture. Photo sensor or SVGA.
+void measureWaveform(int inputPin) {
+	// Show test title
+	bool photo = (inputPin == IN_PIN_PHOTO_SENSOR);
+	lcd.clear();
+	lcd.print(F("Waveform capture"));
+	lcd.setCursor(0, 1);
+	if (photo)
+		lcd.print(F("-> Photosensor"));
+	else
+		lcd.print(F("-> AD2 (eg.SVGA)"));
+	waitMs(TITLE_TIME); if (isAbort()) return;
+
+#ifndef RESULT_STREAM_ENABLED
+	// The traces can only be dumped with the result stream
+	Error(F("Waveform:"), F("No result stream"));
+	return;
+#endif
+
+	// Calibrate
+	struct Calibration calib;
+	if (photo) {
+		if (!calibratePhotoSensor(calib))
+			return;
+	}
+	else {
+		if (!calibrateAD2(calib, true))
+			return;
+	}
+	uint8_t mode = (photo) ? STREAM_MODE_PHOTO : STREAM_MODE_SVGA;
+	streamRunStart(mode);
+
+	// Print
+	lcd.clear();
+	lcd.print(F("Start testing..."));
+	waitMs(1000); if (isAbort()) return;
+	lcd.clear();
+	lcd.setCursor(0, 1);
+	lcd.print(F("Thr: "));
+	lcd.print(calib.threshold);
+
+	// Capture until key pressed
+	uint32_t cycle = 0;
+	while (true) {
+		// Wait a random time until the input is stable
+		int waitRnd = random(70, 150);
+		waitInput(inputPin, calib.threshold, !calib.positiveThreshold, waitRnd * 1000l);
+		if (isAbort()) return;
+
+		// Capture
+		struct WaveformCapture capture;
+		if (!captureWaveform(inputPin, calib.threshold, calib.positiveThreshold, capture))
+			return;
+		cycle++;
+		digitalWrite(OUT_PIN_BUTTON, LOW);
+
+		// Dump
+		streamWaveform(mode, cycle, calib, capture);
+
+		// Print
+		lcd.setCursor(0, 0);
+		lcd.print(cycle);
+		lcd.print(F(": "));
+		lcd.print(usToMsString(ticksToUs(capture.triggerTime)));
+		lcd.print(F("ms     "));
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef __Waveform_H__
+#define __Waveform_H__
+
+#include <Arduino.h>
+
+
+// Captures the trace of the photo sensor (or SVGA) input around the
+// threshold crossing and streams it (see ResultStream.h).
+// The free running ADC samples every 26us. From these samples one is
+// stored every WAVEFORM_PERIOD_US into a ring buffer of WAVEFORM_SAMPLES
+// 8 bit values (ADC value / 4).
+// WAVEFORM_PRE_TRIGGER samples are kept before the crossing.
+// With the defaults the trace covers 6.4ms before and 19.2ms after the crossing.
+
+// Number of samples of a trace. Must be a power of 2.
+#define WAVEFORM_SAMPLES  256
+
+// Number of samples before the crossing.
+#define WAVEFORM_PRE_TRIGGER  64
+
+// Time between 2 samples of the trace.
+#define WAVEFORM_PERIOD_US  100
+
+
+void measureWaveform(int inputPin);
+
+#endif
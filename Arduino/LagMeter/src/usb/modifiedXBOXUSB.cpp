@@ -20,6 +20,7 @@ of the highest if several endpoints request different poll intervals.
  */
 
 #include "modifiedXBOXUSB.h"
+#include "reportintervals.h"
  // To enable serial debugging see "settings.h"
  //#define EXTRADEBUG // Uncomment to get even more debugging data
  //#define PRINTREPORT // Uncomment to print the report send by the Xbox 360 Controller
@@ -239,7 +240,8 @@ uint8_t ModifiedXBOXUSB::Poll() {
 	if (!bPollEnable)
 		return 0;
 	uint16_t BUFFER_SIZE = EP_MAXPKTSIZE;
-	pUsb->inTransfer(bAddress, epInfo[XBOX_INPUT_PIPE].epAddr, &BUFFER_SIZE, readBuf); // input on endpoint 1
+	uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[XBOX_INPUT_PIPE].epAddr, &BUFFER_SIZE, readBuf); // input on endpoint 1
+	reportIntervals.AddTransfer(rcode);
 	readReport();
 #ifdef PRINTREPORT
 	printReport(); // Uncomment "#define PRINTREPORT" to print the report send by the Xbox 360 Controller
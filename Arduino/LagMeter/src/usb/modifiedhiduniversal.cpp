@@ -16,17 +16,24 @@ e-mail   :  support@circuitsathome.com
 
 Note: The sources have been slightly modifed to choose the lowest polling interval instead
 of the highest if several endpoints request different poll intervals.
+The polls are scheduled with micros() at a fixed rate and the timing of the
+polls is recorded (see PollStats).
+The completed transfers of the first interface are recorded by the report
+interval analyzer (see reportintervals.h).
  */
 
 #include "modifiedhiduniversal.h"
+#include "reportintervals.h"
 
 ModifiedHIDUniversal::ModifiedHIDUniversal(USB* p) :
 	USBHID(p),
 	qNextPollTime(0),
+	lastPollTime(0),
 	pollInterval(0),
 	bPollEnable(false),
 	bHasReportId(false) {
 	Initialize();
+	ResetPollStats();
 
 	if (pUsb)
 		pUsb->RegisterDeviceClass(this);
@@ -246,6 +253,8 @@ uint8_t ModifiedHIDUniversal::Init(uint8_t parent, uint8_t port, bool lowspeed)
 
 	OnInitSuccessful();
 
+	qNextPollTime = (uint32_t)micros();
+	ResetPollStats();
 	bPollEnable = true;
 	return 0;
 
@@ -377,8 +386,26 @@ uint8_t ModifiedHIDUniversal::Poll() {
 	if (!bPollEnable)
 		return 0;
 
-	if ((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) {
-		qNextPollTime = (uint32_t)millis() + pollInterval;
+	uint32_t now = (uint32_t)micros();
+	if ((int32_t)(now - qNextPollTime) >= 0L) {
+		// Fixed rate: The next deadline is relative to this deadline, not to
+		// the time of this poll, i.e. a late poll does not shift the phase of
+		// the following polls. If the poll is later than a whole interval
+		// the missed deadlines are skipped.
+		uint32_t interval = (uint32_t)pollInterval * 1000;
+		UpdatePollStats(now, now - qNextPollTime);
+		qNextPollTime += interval;
+		if ((int32_t)(now - qNextPollTime) >= 0L) {
+			if (interval == 0) {
+				qNextPollTime = now;
+			}
+			else {
+				uint32_t missed = (now - qNextPollTime) / interval + 1;
+				qNextPollTime += missed * interval;
+				missed += pollStats.missed;
+				pollStats.missed = (missed > 0xFFFF) ? 0xFFFF : missed;
+			}
+		}
 
 		uint8_t buf[constBuffLen];
 
@@ -389,6 +416,8 @@ uint8_t ModifiedHIDUniversal::Poll() {
 			ZeroMemory(constBuffLen, buf);
 
 			uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[index].epAddr, &read, buf);
+			if (i == 0)
+				reportIntervals.AddTransfer(rcode);
 
 			if (rcode) {
 				if (rcode != hrNAK)
@@ -426,6 +455,40 @@ uint8_t ModifiedHIDUniversal::Poll() {
 	return rcode;
 }
 
+// Resets the timing statistics of the polls.
+void ModifiedHIDUniversal::ResetPollStats() {
+	pollStats.polls = 0;
+	pollStats.sumLate = 0;
+	pollStats.maxLate = 0;
+	pollStats.missed = 0;
+	pollStats.sumInterval = 0;
+	pollStats.minInterval = 0xFFFF;
+	pollStats.maxInterval = 0;
+}
+
+// Adds a poll to the timing statistics.
+// @param now The time of the poll (micros()).
+// @param late The time since the deadline of the poll (in us).
+void ModifiedHIDUniversal::UpdatePollStats(uint32_t now, uint32_t late) {
+	if (late > 0xFFFF)
+		late = 0xFFFF;
+	pollStats.sumLate += late;
+	if (late > pollStats.maxLate)
+		pollStats.maxLate = late;
+	if (pollStats.polls > 0) {
+		uint32_t interval = now - lastPollTime;
+		if (interval > 0xFFFF)
+			interval = 0xFFFF;
+		pollStats.sumInterval += interval;
+		if (interval < pollStats.minInterval)
+			pollStats.minInterval = interval;
+		if (interval > pollStats.maxInterval)
+			pollStats.maxInterval = interval;
+	}
+	pollStats.polls++;
+	lastPollTime = now;
+}
+
 // Send a report to interrupt out endpoint. This is NOT SetReport() request!
 uint8_t ModifiedHIDUniversal::SndRpt(uint16_t nbytes, uint8_t* dataptr) {
 	return pUsb->outTransfer(bAddress, epInfo[epInterruptOutIndex].epAddr, nbytes, dataptr);
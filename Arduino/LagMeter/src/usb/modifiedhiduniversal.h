@@ -17,6 +17,8 @@ e-mail   :  support@circuitsathome.com
 
 Note: The sources have been slightly modifed to choose the lowest polling interval instead
 of the highest if several endpoints request different poll intervals.
+The polls are scheduled with micros() at a fixed rate and the timing of the
+polls is recorded (see PollStats).
 
  */
 
@@ -51,7 +53,8 @@ protected:
 	uint8_t bConfNum; // configuration number
 	uint8_t bNumIface; // number of interfaces in the configuration
 	uint8_t bNumEP; // total number of EP in the configuration
-	uint32_t qNextPollTime; // next poll time
+	uint32_t qNextPollTime; // next poll time (deadline, micros())
+	uint32_t lastPollTime; // time of the last poll (micros())
 	uint8_t pollInterval;
 	bool bPollEnable; // poll enable flag
 
@@ -84,9 +87,32 @@ protected:
 		return;
 	};
 
+public:
+	// Timing of the polls since ResetPollStats().
+	struct PollStats {
+		uint32_t polls; // number of polls
+		uint32_t sumLate; // sum of the delays of the polls after their deadline (us)
+		uint16_t maxLate; // max. delay of a poll after its deadline (us)
+		uint16_t missed; // number of deadlines without poll (skipped because a poll was too late)
+		uint32_t sumInterval; // sum of the times between 2 polls (us)
+		uint16_t minInterval; // min./max. time between 2 polls (us)
+		uint16_t maxInterval;
+	};
+
+protected:
+	PollStats pollStats;
+
+	void UpdatePollStats(uint32_t now, uint32_t late);
+
 public:
 	ModifiedHIDUniversal(USB* p);
 
+	void ResetPollStats();
+
+	const PollStats& GetPollStats() const {
+		return pollStats;
+	};
+
 	// HID implementation
 	bool SetReportParser(uint8_t id, HIDReportParser* prs);
 
@@ -0,0 +1,82 @@
+/*
+Report interval analyzer, see reportintervals.h.
+ */
+
+#include "reportintervals.h"
+#include "Usb.h"
+
+ReportIntervals reportIntervals;
+
+ReportIntervals::ReportIntervals() {
+	Start(false);
+}
+
+void ReportIntervals::Start(bool enable) {
+	enabled = false;
+	reports = 0;
+	naks = 0;
+	errors = 0;
+	startTime = 0;
+	lastTime = 0;
+	sumInterval = 0;
+	minInterval = 0xFFFFFFFF;
+	maxInterval = 0;
+	memset(bins, 0, sizeof(bins));
+	enabled = enable;
+}
+
+void ReportIntervals::AddTransfer(uint8_t rcode) {
+	if (!enabled)
+		return;
+	if (rcode == hrNAK) {
+		naks++;
+		return;
+	}
+	if (rcode) {
+		errors++;
+		return;
+	}
+	uint32_t now = (uint32_t)micros();
+	if (reports == 0) {
+		startTime = now;
+	}
+	else {
+		uint32_t interval = now - lastTime;
+		sumInterval += interval;
+		if (interval < minInterval)
+			minInterval = interval;
+		if (interval > maxInterval)
+			maxInterval = interval;
+		uint32_t bin = interval / REPORT_INTERVAL_BIN_WIDTH;
+		if (bin > REPORT_INTERVAL_BINS)
+			bin = REPORT_INTERVAL_BINS;
+		if (bins[bin] < 0xFFFF)
+			bins[bin]++;
+	}
+	lastTime = now;
+	reports++;
+}
+
+uint32_t ReportIntervals::GetMeanInterval() const {
+	if (reports < 2)
+		return 0;
+	return sumInterval / (reports - 1);
+}
+
+uint32_t ReportIntervals::GetPercentile(uint8_t percent) const {
+	uint32_t count = 0;
+	for (uint8_t i = 0; i <= REPORT_INTERVAL_BINS; i++)
+		count += bins[i];
+	if (count == 0)
+		return 0;
+	// Interpolate inside the bin
+	uint32_t target = count * percent;	// in 1/100
+	uint32_t sum = 0;
+	for (uint8_t i = 0; i < REPORT_INTERVAL_BINS; i++) {
+		uint32_t next = sum + (uint32_t)bins[i] * 100;
+		if (next >= target && bins[i] > 0)
+			return i * REPORT_INTERVAL_BIN_WIDTH + (target - sum) * REPORT_INTERVAL_BIN_WIDTH / ((uint32_t)bins[i] * 100);
+		sum = next;
+	}
+	return maxInterval;
+}
@@ -0,0 +1,58 @@
+/*
+Report interval analyzer.
+Timestamps the completed interrupt IN transfers of the game controller
+(ModifiedHIDUniversal::Poll() and ModifiedXBOXUSB::Poll()) and counts the
+NAKed polls (the device had no new report).
+Used to measure the real report rate of a device instead of trusting the
+requested poll interval.
+ */
+
+#if !defined(__REPORTINTERVALS_H__)
+#define __REPORTINTERVALS_H__
+
+#include <Arduino.h>
+
+// Number of bins of the interval histogram. The values above the last bin
+// are counted in an extra bin.
+#define REPORT_INTERVAL_BINS  32
+// Width of a bin (in us).
+#define REPORT_INTERVAL_BIN_WIDTH  500
+
+class ReportIntervals {
+protected:
+	bool enabled;
+	uint32_t lastTime; // time of the last report (micros())
+
+public:
+	uint32_t reports; // completed transfers
+	uint32_t naks; // polls without report
+	uint32_t errors; // other errors
+	uint32_t startTime; // time of the first report (micros())
+	uint32_t sumInterval; // sum of the intervals (us)
+	uint32_t minInterval; // min./max. interval (us)
+	uint32_t maxInterval;
+	uint16_t bins[REPORT_INTERVAL_BINS + 1]; // histogram of the intervals
+
+	ReportIntervals();
+
+	// Clears the statistics and starts (or stops) the recording.
+	void Start(bool enable);
+
+	bool IsEnabled() const {
+		return enabled;
+	};
+
+	// Records the result of an interrupt IN transfer.
+	// @param rcode The result of inTransfer().
+	void AddTransfer(uint8_t rcode);
+
+	// Returns the mean interval between 2 reports (in us), 0 if not known.
+	uint32_t GetMeanInterval() const;
+
+	// Returns the interval below which 'percent' of the intervals are (in us).
+	uint32_t GetPercentile(uint8_t percent) const;
+};
+
+extern ReportIntervals reportIntervals;
+
+#endif // __REPORTINTERVALS_H__
@@ -0,0 +1,634 @@
+/**
+ * Description:
+ * Collects the binary result stream of the LagMeter (RESULT_STREAM_ENABLED)
+ * from the serial port or from a recorded file.
+ * The frames are decoded (COBS, CRC16) and for each run the running
+ * statistics (average, standard deviation, min/max) and a histogram
+ * (percentiles) are calculated. Nothing is kept in memory per cycle,
+ * so also long soak runs can be collected.
+ * At the end of each run a summary is printed.
+ *
+ * Compile:
+ * gcc -g -Wall LagStream.cpp -lm
+ * or make.
+ *
+ * Run e.g.:
+ * ./lagstream /dev/ttyACM0 -c cycles.csv -s summary.txt -r record.bin
+ * ./lagstream record.bin -c cycles.csv -w waveforms.csv
+ *
+ * Options:
+ * -c file: Writes each cycle to a CSV file.
+ * -w file: Writes the captured waveforms to a CSV file.
+ * -s file: Writes the run summaries also to a file.
+ * -r file: Records the raw stream (to be read again later).
+ *
+ * Notes:
+ * The record format is defined in
+ * Arduino/LagMeter/src/Measurement/StreamProtocol.h.
+ * To access the serial port on linux as normal user you need to give access rights with:
+ * sudo usermod -a -G dialout <user>
+ * and then reboot.
+ * Stop with Ctrl-C. The summary of an unfinished run is printed.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <termios.h>
+
+#include "../../Arduino/LagMeter/src/Measurement/StreamProtocol.h"
+
+
+// Histogram resolution (in us) and size: 0.1ms bins up to 2s.
+#define BIN_WIDTH_US    100
+#define BIN_COUNT       20000
+
+// Max. number of samples of a waveform.
+#define MAX_WAVEFORM_SAMPLES    4096
+
+
+/**
+ * The statistics of one run.
+ */
+struct run_state {
+    bool active;
+    int index;              // Number of the run, starting at 1
+    uint8_t mode;
+    uint8_t ticks_per_us;
+    double frame_period;    // Frame period of the display in us, 0 if not known
+    uint32_t last_cycle;    // To detect lost records
+    uint32_t lost;          // Cycles missing in the sequence
+    uint32_t dropped;       // Reported by the LagMeter (buffer full)
+    // Sampling statistics (reported at the end of the run)
+    uint16_t sample_cycles;
+    uint32_t samples;
+    double min_interval;    // in us
+    double mean_interval;
+    double max_interval;
+    // Welford
+    uint64_t count;
+    double mean;
+    double m2;
+    double min;
+    double max;
+    // Response time (10% -> 90%)
+    double press_response_sum;
+    double release_response_sum;
+    // Source lag (SVGA -> Photosensor)
+    double wait_sum;
+    // Press time of the recognized presses (min press time, poll period)
+    uint16_t min_press_time;  // in ms
+    uint16_t max_press_time;
+    // Histogram
+    uint32_t bins[BIN_COUNT];
+};
+
+
+/**
+ * Decoder statistics.
+ */
+struct decoder_state {
+    uint8_t frame[STREAM_MAX_FRAME_SIZE];
+    size_t len;
+    bool overflow;
+    uint64_t frames;
+    uint64_t crc_errors;
+    uint64_t format_errors;
+};
+
+
+/**
+ * The waveform that is currently received.
+ */
+struct waveform_state {
+    bool active;
+    struct StreamWaveform header;
+    uint8_t samples[MAX_WAVEFORM_SAMPLES];
+    uint16_t received;
+};
+
+
+// Set by Ctrl-C.
+static volatile sig_atomic_t stop_requested = 0;
+
+static FILE *csv_file = NULL;
+static FILE *summary_file = NULL;
+static FILE *waveform_file = NULL;
+static struct run_state run;
+static struct waveform_state waveform;
+static struct decoder_state decoder;
+
+
+/**
+ * Called on Ctrl-C.
+ */
+void handle_sigint(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+
+/**
+ * Returns the name of a measurement mode.
+ */
+const char *mode_name(uint8_t mode)
+{
+    switch (mode) {
+        case STREAM_MODE_PHOTO:     return "Button->Photo";
+        case STREAM_MODE_SVGA:      return "Button->SVGA";
+        case STREAM_MODE_MONITOR:   return "SVGA->Photo";
+        case STREAM_MODE_MIN_PRESS: return "MinPressTime";
+        case STREAM_MODE_USB:       return "USB";
+        case STREAM_MODE_RESPONSE:  return "ResponseTime";
+        case STREAM_MODE_POLL_PERIOD: return "PollPeriod";
+        default:                    return "Unknown";
+    }
+}
+
+
+/**
+ * Configures the serial port: raw, 8N1, STREAM_BAUDRATE.
+ *
+ * Returns 0 on success. Otherwise -1 is returned.
+ */
+int setup_serial(int fd)
+{
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0)
+        return -1;
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, B500000);
+    cfsetospeed(&tty, B500000);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tty) != 0)
+        return -1;
+    tcflush(fd, TCIFLUSH);
+    return 0;
+}
+
+
+/**
+ * Returns the value at the given percentile (in us) of the run's histogram.
+ * Interpolates inside the bin.
+ */
+double get_percentile(const struct run_state *r, int percent)
+{
+    if (r->count == 0)
+        return 0.0;
+    double target = r->count * percent / 100.0;
+    double sum = 0.0;
+    for (int i = 0; i < BIN_COUNT; i++) {
+        if (r->bins[i] == 0)
+            continue;
+        if (sum + r->bins[i] >= target) {
+            double value = (i + (target - sum) / r->bins[i]) * BIN_WIDTH_US;
+            if (value < r->min)
+                value = r->min;
+            if (value > r->max)
+                value = r->max;
+            return value;
+        }
+        sum += r->bins[i];
+    }
+    return r->max;
+}
+
+
+/**
+ * Prints the summary of a run to 'out'.
+ */
+void print_summary(FILE *out, const struct run_state *r, bool finished)
+{
+    double sd = (r->count > 1) ? sqrt(r->m2 / (r->count - 1)) : 0.0;
+    double ci = (r->count > 1) ? 1.96 * sd / sqrt((double)r->count) : 0.0;
+    fprintf(out, "Run %d: %s%s\n", r->index, mode_name(r->mode), finished ? "" : " (not finished)");
+    fprintf(out, "  Cycles:  %llu (lost %u, dropped %u)\n", (unsigned long long)r->count, r->lost, r->dropped);
+    if (r->count == 0)
+        return;
+    fprintf(out, "  Average: %.2f ms (+-%.2f ms, 95%% CI)\n", r->mean / 1000.0, ci / 1000.0);
+    if (r->frame_period > 0)
+        fprintf(out, "  Frames:  %.2f (frame period %.3f ms)\n", r->mean / r->frame_period, r->frame_period / 1000.0);
+    fprintf(out, "  Std dev: %.2f ms\n", sd / 1000.0);
+    fprintf(out, "  Min/max: %.2f - %.2f ms\n", r->min / 1000.0, r->max / 1000.0);
+    if (r->sample_cycles > 0 && r->samples > 0)
+        fprintf(out, "  Sampling: %u samples/cycle, interval %.1f / %.1f / %.1f us (min/mean/max)\n",
+            r->samples / r->sample_cycles, r->min_interval, r->mean_interval, r->max_interval);
+    fprintf(out, "  p50/p95/p99: %.1f / %.1f / %.1f ms\n",
+        get_percentile(r, 50) / 1000.0, get_percentile(r, 95) / 1000.0, get_percentile(r, 99) / 1000.0);
+    if (r->mode == STREAM_MODE_MONITOR) {
+        fprintf(out, "  (Lag = display lag from SVGA to photosensor)\n");
+        fprintf(out, "  Source lag: %.2f ms, total: %.2f ms\n",
+            r->wait_sum / r->count / 1000.0, (r->wait_sum / r->count + r->mean) / 1000.0);
+    }
+    if (r->mode == STREAM_MODE_MIN_PRESS || r->mode == STREAM_MODE_POLL_PERIOD) {
+        if (r->mode == STREAM_MODE_POLL_PERIOD)
+            fprintf(out, "  (Lag = reaction time of the recognized presses of the press time sweep)\n");
+        fprintf(out, "  Press time: %u - %u ms (recognized presses)\n", r->min_press_time, r->max_press_time);
+    }
+    if (r->mode == STREAM_MODE_RESPONSE) {
+        fprintf(out, "  (Lag = processing lag until the 10%% crossing)\n");
+        fprintf(out, "  Response 10-90%%: press %.2f ms, release %.2f ms\n",
+            r->press_response_sum / r->count / 1000.0, r->release_response_sum / r->count / 1000.0);
+    }
+}
+
+
+/**
+ * Ends the current run and prints the summary.
+ */
+void end_run(bool finished)
+{
+    if (!run.active)
+        return;
+    run.active = false;
+    // E.g. waveform capture
+    if (run.count == 0)
+        return;
+    print_summary(stdout, &run, finished);
+    if (summary_file) {
+        print_summary(summary_file, &run, finished);
+        fflush(summary_file);
+    }
+}
+
+
+/**
+ * Starts a new run.
+ */
+void start_run(uint8_t mode, uint8_t ticks_per_us, double frame_period)
+{
+    end_run(false);
+    int index = run.index + 1;
+    memset(&run, 0, sizeof(run));
+    run.active = true;
+    run.index = index;
+    run.mode = mode;
+    run.ticks_per_us = (ticks_per_us > 0) ? ticks_per_us : 2;
+    run.frame_period = frame_period;
+}
+
+
+/**
+ * Adds the lag of one cycle to the run statistics.
+ *
+ * Returns the lag in us.
+ */
+double add_lag(uint8_t mode, uint32_t cycle, uint32_t ticks)
+{
+    // A cycle without run start (e.g. the tool was started late)
+    if (!run.active || run.mode != mode)
+        start_run(mode, run.ticks_per_us, run.frame_period);
+
+    // Check for lost records
+    if (run.last_cycle != 0 && cycle > run.last_cycle + 1)
+        run.lost += cycle - run.last_cycle - 1;
+    run.last_cycle = cycle;
+
+    // Welford
+    double us = (double)ticks / run.ticks_per_us;
+    run.count++;
+    if (run.count == 1) {
+        run.min = us;
+        run.max = us;
+    }
+    else {
+        if (us < run.min)
+            run.min = us;
+        if (us > run.max)
+            run.max = us;
+    }
+    double delta = us - run.mean;
+    run.mean += delta / run.count;
+    run.m2 += delta * (us - run.mean);
+
+    // Histogram
+    long bin = (long)(us / BIN_WIDTH_US);
+    if (bin >= BIN_COUNT)
+        bin = BIN_COUNT - 1;
+    run.bins[bin]++;
+    return us;
+}
+
+
+/**
+ * Adds one cycle to the run statistics and the CSV file.
+ */
+void add_cycle(const struct StreamCycle *c)
+{
+    double us = add_lag(c->mode, c->cycle, c->ticks);
+    double wait_us = (double)c->waitTicks / run.ticks_per_us;
+    run.wait_sum += wait_us;
+    if (run.count == 1 || c->pressTime < run.min_press_time)
+        run.min_press_time = c->pressTime;
+    if (c->pressTime > run.max_press_time)
+        run.max_press_time = c->pressTime;
+
+    // CSV
+    if (csv_file) {
+        fprintf(csv_file, "%d,%s,%u,%u,%.1f,%d,%d,%u,%d,,,%.1f\n",
+            run.index, mode_name(c->mode), c->cycle, c->ticks, us,
+            c->threshold, c->thresholdWait, c->pressTime,
+            (c->flags & STREAM_FLAG_POSITIVE_THRESHOLD) ? 1 : 0, wait_us);
+    }
+}
+
+
+/**
+ * Adds one response time cycle to the run statistics and the CSV file.
+ * The lag is the time until the 10% crossing after the press.
+ */
+void add_response(const struct StreamResponse *r)
+{
+    double us = add_lag(r->mode, r->cycle, r->pressTicks[0]);
+    double press = (double)(r->pressTicks[2] - r->pressTicks[0]) / run.ticks_per_us;
+    double release = (double)(r->releaseTicks[2] - r->releaseTicks[0]) / run.ticks_per_us;
+    run.press_response_sum += press;
+    run.release_response_sum += release;
+
+    // CSV
+    if (csv_file) {
+        fprintf(csv_file, "%d,%s,%u,%u,%.1f,,,,,%.1f,%.1f,\n",
+            run.index, mode_name(r->mode), r->cycle, r->pressTicks[0], us, press, release);
+    }
+}
+
+
+/**
+ * Writes the completed waveform to the CSV file.
+ * Times are in us since the button press and relative to the crossing.
+ */
+void write_waveform(const struct waveform_state *w)
+{
+    const struct StreamWaveform *h = &w->header;
+    double ticks_per_us = (run.ticks_per_us > 0) ? run.ticks_per_us : 2;
+    double trigger_us = h->triggerTicks / ticks_per_us;
+    printf("Waveform %u: %s, crossing at %.1f ms\n", h->cycle, mode_name(h->mode), trigger_us / 1000.0);
+    if (!waveform_file)
+        return;
+    for (uint16_t i = 0; i < h->count; i++) {
+        double us = (h->firstTicks + (double)i * h->periodTicks) / ticks_per_us;
+        fprintf(waveform_file, "%u,%s,%u,%.1f,%.1f,%d,%d,%d,%d\n",
+            h->cycle, mode_name(h->mode), i, us, us - trigger_us,
+            w->samples[i] * 4, h->threshold, h->levelOn, h->levelOff);
+    }
+}
+
+
+/**
+ * Handles the waveform header and data records.
+ */
+void add_waveform_data(const uint8_t *data, size_t size)
+{
+    if (data[0] == STREAM_RECORD_WAVEFORM) {
+        memcpy(&waveform.header, data, sizeof(waveform.header));
+        waveform.received = 0;
+        waveform.active = (waveform.header.count <= MAX_WAVEFORM_SAMPLES);
+        if (!waveform.active)
+            decoder.format_errors++;
+        return;
+    }
+
+    // Data
+    struct StreamWaveformData d;
+    memcpy(&d, data, size);
+    size_t n = size - (sizeof(d) - STREAM_WAVEFORM_CHUNK);
+    if (!waveform.active || d.offset != waveform.received || d.offset + n > waveform.header.count) {
+        // Missing header or data
+        waveform.active = false;
+        decoder.format_errors++;
+        return;
+    }
+    memcpy(&waveform.samples[d.offset], d.samples, n);
+    waveform.received += n;
+    if (waveform.received == waveform.header.count) {
+        write_waveform(&waveform);
+        waveform.active = false;
+    }
+}
+
+
+/**
+ * Decodes a COBS frame (without delimiter) in place, checks the CRC
+ * and handles the record.
+ */
+void handle_frame(uint8_t *frame, size_t len)
+{
+    // COBS decode
+    uint8_t data[STREAM_MAX_FRAME_SIZE];
+    size_t size = 0;
+    size_t i = 0;
+    while (i < len) {
+        uint8_t code = frame[i++];
+        if (code == 0 || i + code - 1 > len) {
+            decoder.format_errors++;
+            return;
+        }
+        for (uint8_t k = 1; k < code; k++)
+            data[size++] = frame[i++];
+        if (code < 0xFF && i < len)
+            data[size++] = 0;
+    }
+
+    // CRC
+    if (size < 3) {
+        decoder.format_errors++;
+        return;
+    }
+    size -= 2;
+    uint16_t crc = data[size] | (data[size + 1] << 8);
+    if (crc != streamCrc16(data, size)) {
+        decoder.crc_errors++;
+        return;
+    }
+    decoder.frames++;
+
+    // Record
+    switch (data[0]) {
+        case STREAM_RECORD_RUN_START: {
+            struct StreamRunStart r;
+            if (size != sizeof(r))
+                break;
+            memcpy(&r, data, sizeof(r));
+            if (r.version != STREAM_PROTOCOL_VERSION)
+                fprintf(stderr, "Warning: protocol version %d, expected %d.\n", r.version, STREAM_PROTOCOL_VERSION);
+            start_run(r.mode, r.ticksPerUs, r.framePeriodNs / 1000.0);
+            return;
+        }
+        case STREAM_RECORD_CYCLE: {
+            struct StreamCycle c;
+            if (size != sizeof(c))
+                break;
+            memcpy(&c, data, sizeof(c));
+            add_cycle(&c);
+            return;
+        }
+        case STREAM_RECORD_RUN_END: {
+            struct StreamRunEnd e;
+            if (size != sizeof(e))
+                break;
+            memcpy(&e, data, sizeof(e));
+            run.dropped = e.dropped;
+            run.sample_cycles = e.sampleCycles;
+            run.samples = e.samples;
+            run.min_interval = (double)e.minInterval / run.ticks_per_us;
+            run.mean_interval = (double)e.meanInterval / run.ticks_per_us;
+            run.max_interval = (double)e.maxInterval / run.ticks_per_us;
+            end_run(true);
+            return;
+        }
+        case STREAM_RECORD_RESPONSE: {
+            struct StreamResponse r;
+            if (size != sizeof(r))
+                break;
+            memcpy(&r, data, sizeof(r));
+            add_response(&r);
+            return;
+        }
+        case STREAM_RECORD_WAVEFORM:
+            if (size != sizeof(struct StreamWaveform))
+                break;
+            add_waveform_data(data, size);
+            return;
+        case STREAM_RECORD_WAVEFORM_DATA:
+            if (size <= sizeof(struct StreamWaveformData) - STREAM_WAVEFORM_CHUNK || size > sizeof(struct StreamWaveformData))
+                break;
+            add_waveform_data(data, size);
+            return;
+    }
+    decoder.format_errors++;
+}
+
+
+/**
+ * Feeds received bytes into the frame decoder.
+ */
+void decode_bytes(const uint8_t *buffer, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint8_t b = buffer[i];
+        if (b == 0) {
+            // End of frame
+            if (decoder.overflow)
+                decoder.format_errors++;
+            else if (decoder.len > 0)
+                handle_frame(decoder.frame, decoder.len);
+            decoder.len = 0;
+            decoder.overflow = false;
+            continue;
+        }
+        if (decoder.len < sizeof(decoder.frame))
+            decoder.frame[decoder.len++] = b;
+        else
+            decoder.overflow = true;
+    }
+}
+
+
+/**
+ * Opens a file for writing or exits.
+ */
+FILE *open_output(const char *path, const char *mode)
+{
+    FILE *f = fopen(path, mode);
+    if (!f) {
+        perror(path);
+        exit(-1);
+    }
+    return f;
+}
+
+
+// Main program
+int main(int argc, char *argv[])
+{
+    const char *input = NULL;
+    FILE *record_file = NULL;
+
+    // Arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            csv_file = open_output(argv[++i], "w");
+            fprintf(csv_file, "run,mode,cycle,ticks,us,threshold,threshold_wait,press_time_ms,positive_threshold,response_press_us,response_release_us,source_us\n");
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            waveform_file = open_output(argv[++i], "w");
+            fprintf(waveform_file, "capture,mode,index,us,us_from_crossing,value,threshold,level_on,level_off\n");
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            summary_file = open_output(argv[++i], "a");
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            record_file = open_output(argv[++i], "wb");
+        else if (argv[i][0] != '-' && !input)
+            input = argv[i];
+        else {
+            fprintf(stderr, "Usage: %s <serial device | recorded file> [-c csv] [-w waveforms] [-s summary] [-r record]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!input) {
+        fprintf(stderr, "Usage: %s <serial device | recorded file> [-c csv] [-w waveforms] [-s summary] [-r record]\n", argv[0]);
+        return -1;
+    }
+
+    // Open input
+    int fd = open(input, O_RDONLY | O_NOCTTY);
+    if (fd == -1) {
+        perror("Could not open input");
+        return -1;
+    }
+    if (isatty(fd)) {
+        if (setup_serial(fd) != 0) {
+            perror("Could not configure serial port");
+            return -1;
+        }
+        printf("Reading from %s. Stop with Ctrl-C.\n", input);
+    }
+
+    // Ctrl-C interrupts read()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    // Read until end of file or Ctrl-C
+    uint8_t buffer[4096];
+    while (!stop_requested) {
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Read error");
+            break;
+        }
+        if (count == 0)
+            break;
+        if (record_file)
+            fwrite(buffer, 1, count, record_file);
+        decode_bytes(buffer, count);
+    }
+
+    // Summary of an unfinished run
+    end_run(false);
+    printf("Frames: %llu, CRC errors: %llu, format errors: %llu\n",
+        (unsigned long long)decoder.frames, (unsigned long long)decoder.crc_errors,
+        (unsigned long long)decoder.format_errors);
+
+    close(fd);
+    if (csv_file)
+        fclose(csv_file);
+    if (summary_file)
+        fclose(summary_file);
+    if (waveform_file)
+        fclose(waveform_file);
+    if (record_file)
+        fclose(record_file);
+    return 0;
+}